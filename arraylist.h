@@ -62,11 +62,21 @@
 		} 							\
 		if ((alh).head == NULL ||				\
 		    (alh).allocated < (alh).len + 1) { 			\
-			(alh).allocated +=				\
-			    (alh).blocksize ? : 8; 			\
+			/* Geometric growth: the first allocation is	\
+			 * one block, after that the array doubles, so	\
+			 * n appends cost O(n) copying instead of	\
+			 * O(n^2 / blocksize). */			\
+			unsigned int _n = (alh).allocated ?		\
+			    (alh).allocated * 2 :			\
+			    ((alh).blocksize ? : 8); 			\
+			if (_n < (alh).len + 1)	/* overflow */		\
+				_n = (alh).len + 1;			\
 			(alh).head = recallocarray((alh).head, 		\
-			    (alh).len, (alh).allocated,			\
-			    sizeof(*(alh).head)); 			\
+			    (alh).len, _n, sizeof(*(alh).head)); 	\
+			if ((alh).head != NULL)				\
+				(alh).allocated = _n;			\
+			else						\
+				(alh).allocated = 0;			\
 		} 							\
 		if ((alh).head == NULL ||				\
 		    (alh).allocated < (alh).len + 1) { 			\
@@ -77,6 +87,28 @@
 		(alh).len++; 						\
 } while (0)
 
+/*
+ * Pre-allocate room for at least nelems additional members, so that
+ * the ARRAYLIST_ADDs that follow don't have to grow the array step by
+ * step.  Best effort: on allocation failure the list is left as it
+ * was and the next ARRAYLIST_ADD reports the problem.
+ */
+#define ARRAYLIST_RESERVE(alh, nelems) do {				\
+		void *_p;						\
+		if ((alh).len && (alh).allocated == 0)			\
+			break;						\
+		if ((alh).len + (nelems) < (alh).len)	/* overflow */	\
+			break;						\
+		if ((alh).allocated >= (alh).len + (nelems))		\
+			break;						\
+		_p = recallocarray((alh).head, (alh).len,		\
+		    (alh).len + (nelems), sizeof(*(alh).head));		\
+		if (_p == NULL)						\
+			break;						\
+		(alh).head = _p;					\
+		(alh).allocated = (alh).len + (nelems);			\
+} while (0)
+
 #define ARRAYLIST_CLEAR(alh)						\
 	(alh).len = 0
 
@@ -39,12 +39,13 @@ dump_atom(const struct diff_data *left, const struct diff_data *right, const str
 	}
 	if (left)
 		print(" %3ld", DD_ROOT_INDEX(left, atom));
-	if (right && atom->patience.pos_in_other)
-		print(" %3ld", DD_ROOT_INDEX(right,
-		    atom->patience.pos_in_other));
 
-	print(" %s%s '", atom->patience.unique_here ? "u" : " ",
-	    atom->patience.unique_in_both ? "c" : " ");
+	/*
+	 * The patience state (uniqueness flags, position in the other
+	 * file) lives in a side array private to diff_patience.c now,
+	 * so it can no longer be dumped from here.
+	 */
+	print(" '");
 	for (s = atom->at; s < (const char*)(atom->at + atom->len); s++) {
 		if (*s == '\r')
 			print("\\r");
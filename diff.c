@@ -24,13 +24,18 @@
 #include <sys/stat.h>
 
 #include <assert.h>
+#include <dirent.h>
 #include <err.h>
+#include <stdatomic.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "diff_main.h"
@@ -50,13 +55,46 @@ struct output_info {
 	int format;
 	int context;
 	int ignore_blanks;
+	int show_stats;
+	int quick;
+	int use_cache;
+
+	/* Where the rendered diff goes; stdout for a plain diff. */
+	FILE *out;
 };
 
+/*
+ * One unit of work for the recursive directory mode: either a pair of
+ * files to diff, or a message about an entry existing on one side only
+ * (or having mismatching types).
+ */
+struct dir_pair {
+	char *left;		/* full path, or NULL if msg is set */
+	char *right;
+	char *msg;		/* preformatted line, or NULL */
+};
+
+ARRAYLIST_HEAD(dir_pair_arraylist, dir_pair);
+
 __dead void	 usage(void);
 char		*mmapfile(const char *, struct stat *);
 void		 output(const struct diff_result *, const struct output_info *);
-
-const struct diff_algo_config myers, patience, myers_divide;
+void		 print_lines(FILE *, const char *, struct diff_atom *,
+		    unsigned int);
+int		 diff_file_pair(const struct output_info *, const char *,
+		    const char *, const char *, FILE *);
+static void	 diff_dirs(const char *, const char *, struct output_info *,
+		    const char *, unsigned int);
+static int	 atom_cache_load(const char *, const struct stat *,
+		    struct diff_data *);
+static int	 quick_differ(const struct output_info *, const char *,
+		    const struct stat *, const char *, const struct stat *);
+static int	 buffer_is_binary(const char *, size_t);
+static int	 batch_mode(const struct output_info *, const char *);
+static void	 atom_cache_store(const char *, const struct stat *,
+		    const struct diff_data *);
+
+const struct diff_algo_config myers, patience, myers_divide, histogram;
 
 const struct diff_algo_config myers = {
 	.impl = diff_algo_myers,
@@ -80,34 +118,85 @@ const struct diff_algo_config myers_divide = (struct diff_algo_config){
 	.fallback_algo = NULL,
 };
 
-const struct diff_config diff_config = {
-	.atomize_func = diff_atomize_text_by_line,
+const struct diff_algo_config histogram = {
+	.impl = diff_algo_histogram,
+	/* After subdivision, do Histogram again. */
+	.inner_algo = &histogram,
+	/* Without a usable anchor, do Myers Divide et Impera. */
+	.fallback_algo = &myers_divide,
+};
+
+struct diff_config diff_config = {
+	.atomize_func = diff_atomize_text_by_line_parallel,
 	.algo = &myers,
 };
 
 __dead void
 usage(void)
 {
-	fprintf(stderr, "usage: %s [-c | -e | -f | -u] [-b] file1 file2\n",
+	fprintf(stderr,
+	    "usage: %s [-c | -e | -f | -u] [-BbqrsS] [-A algo]"
+	    " file1 file2\n",
 	    getprogname());
 	exit(1);
 }
 
+/* The flag string echoed in per-file 'diff ...' header lines. */
+static void
+build_flagstr(const struct output_info *info, char *buf)
+{
+	int fi = 0;
+
+	buf[fi++] = '-';
+	if (info->format == F_UNIFIED)
+		buf[fi++] = 'u';
+	else if (info->format == F_CFORMAT)
+		buf[fi++] = 'c';
+	else if (info->format == F_ED)
+		buf[fi++] = 'e';
+	else if (info->format == F_FFORMAT)
+		buf[fi++] = 'f';
+	if (info->ignore_blanks)
+		buf[fi++] = 'b';
+	if (fi == 1)
+		fi = 0;
+	buf[fi] = '\0';
+}
+
 int
 main(int argc, char *argv[])
 {
-	struct diff_result *result;
 	struct output_info info;
 	struct stat lsb, rsb;
-	char *ep, *lbuf, *rbuf;
-	long lval;
-	int ch;
+	char *ep;
+	char flagstr[8];
+	long lval, ncpu;
+	int ch, batch = 0, recursive = 0;
 
 	memset(&info, 0, sizeof(info));
 	info.context = DEFAULT_CONTEXT;
+	info.out = stdout;
+	setvbuf(stdout, NULL, _IOFBF, 256 * 1024);
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu > 1)
+		diff_config.solver_threads = (unsigned int)ncpu;
 
-	while ((ch = getopt(argc, argv, "bCc:efU:u")) != -1) {
+	while ((ch = getopt(argc, argv, "A:BbC:cefqrsSU:u")) != -1) {
 		switch (ch) {
+		case 'A':
+			if (strcmp(optarg, "myers") == 0)
+				diff_config.algo = &myers;
+			else if (strcmp(optarg, "patience") == 0)
+				diff_config.algo = &patience;
+			else if (strcmp(optarg, "histogram") == 0)
+				diff_config.algo = &histogram;
+			else
+				usage();
+			break;
+		case 'B':
+			batch = 1;
+			break;
 		case 'b':
 			info.ignore_blanks = 1;
 			break;
@@ -132,6 +221,18 @@ main(int argc, char *argv[])
 				usage();
 			info.format = F_FFORMAT;
 			break;
+		case 'q':
+			info.quick = 1;
+			break;
+		case 'r':
+			recursive = 1;
+			break;
+		case 's':
+			info.show_stats = 1;
+			break;
+		case 'S':
+			info.use_cache = 1;
+			break;
 		case 'U':
 			lval = strtol(optarg, &ep, 10);
 			if (*ep != '\0' || lval < 0 || lval >= INT_MAX)
@@ -151,29 +252,46 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
+	if (info.ignore_blanks)
+		diff_config.flags |= DIFF_FLAG_IGNORE_WHITESPACE;
+	build_flagstr(&info, flagstr);
+
+	if (batch) {
+		if (argc != 0)
+			usage();
+		return batch_mode(&info, flagstr);
+	}
+
 	if (argc != 2)
 		usage();
 
-	info.left_path = argv[0];
-	info.right_path = argv[1];
-	lbuf = mmapfile(info.left_path, &lsb);
-	rbuf = mmapfile(info.right_path, &rsb);
+	if (recursive) {
+		if (stat(argv[0], &lsb) == -1)
+			err(2, "%s", argv[0]);
+		if (stat(argv[1], &rsb) == -1)
+			err(2, "%s", argv[1]);
+		if (!S_ISDIR(lsb.st_mode) || !S_ISDIR(rsb.st_mode))
+			errx(2, "-r requires two directories");
 
-	result = diff_main(&diff_config, lbuf, lsb.st_size, rbuf, rsb.st_size);
-	if (result == NULL)
-		return DIFF_RC_EINVAL;
-	if (result->rc != DIFF_RC_OK)
-		return result->rc;
+		/*
+		 * Parallelize across file pairs rather than inside the
+		 * single diffs, to keep the thread count bounded.
+		 */
+		diff_config.solver_threads = 0;
+		diff_dirs(argv[0], argv[1], &info, flagstr,
+		    ncpu > 1 ? (unsigned int)ncpu : 1);
+		return 0;
+	}
 
-	info.left_time = lsb.st_mtime;
-	info.right_time = rsb.st_mtime;
-	output(result, &info);
+	info.left_path = argv[0];
+	info.right_path = argv[1];
 
-	diff_result_free(result);
-	munmap(lbuf, lsb.st_size);
-	munmap(rbuf, rsb.st_size);
+	{
+		int differ = diff_file_pair(&info, NULL, argv[0], argv[1],
+		    stdout);
 
-	return 0;
+		return info.quick ? differ : 0;
+	}
 }
 
 char *
@@ -192,40 +310,77 @@ mmapfile(const char *path, struct stat *st)
 	if ((uintmax_t)st->st_size > SIZE_MAX)
 		errx(2, "%s: file too big to fit memory", path);
 
+	/* mmap(2) cannot map empty files; nothing to read anyway. */
+	if (st->st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+
 	p = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
 	if (p == MAP_FAILED)
 		err(2, "mmap");
 
+	/*
+	 * Atomization reads the whole mapping front to back; telling
+	 * the kernel so enables aggressive readahead and early reuse of
+	 * the pages behind us, which is what lets files larger than
+	 * memory stream through the 64-bit address space instead of
+	 * thrashing.
+	 */
+	(void)posix_madvise(p, st->st_size, POSIX_MADV_SEQUENTIAL);
+
 	close(fd);
 
 	return p;
 }
 
 void
-print_lines(const char *prefix, struct diff_atom *start_atom,
+print_lines(FILE *out, const char *prefix, struct diff_atom *start_atom,
     unsigned int count)
 {
 	struct diff_atom *atom;
 
 	foreach_diff_atom(atom, start_atom, count) {
 		unsigned int len = atom->len;
+		bool clean = true;
 		int i;
 
-		printf("%s", prefix);
+		fputs(prefix, out);
 		if (len && atom->at[len - 1] == '\n') {
 			len--;
 			if (len && atom->at[len - 1] == '\r')
 				len--;
 		}
 
+		/*
+		 * The overwhelmingly common case is a line with nothing
+		 * to escape; write it with a single fwrite(3) straight
+		 * from the mapped input instead of going through stdio
+		 * one character at a time.
+		 */
 		for (i = 0; i < len; i++) {
 			char c = atom->at[i];
-			if ((c < 0x20 || c >= 0x7f) && c != '\t')
-				printf("\\x%02x", (unsigned char)c);
-			else
-				printf("%c", c);
+
+			if ((c < 0x20 || c >= 0x7f) && c != '\t') {
+				clean = false;
+				break;
+			}
+		}
+
+		if (clean)
+			fwrite(atom->at, 1, len, out);
+		else {
+			for (i = 0; i < len; i++) {
+				char c = atom->at[i];
+
+				if ((c < 0x20 || c >= 0x7f) && c != '\t')
+					fprintf(out, "\\x%02x",
+					    (unsigned char)c);
+				else
+					putc(c, out);
+			}
 		}
-		printf("\n");
+		putc('\n', out);
 	}
 }
 
@@ -342,25 +497,30 @@ print_default(const struct diff_result *result, const struct output_info *info,
 	}
 
 	if (cleft && cright) {
-		printf("%dc%d\n", cc->left.start + 1, cc->right.start + 1);
-		print_lines("< ", cleft->left_start, cleft->left_count);
-		printf("---\n");
-		print_lines("> ", cright->right_start, cright->right_count);
+		fprintf(info->out, "%dc%d\n", cc->left.start + 1,
+		    cc->right.start + 1);
+		print_lines(info->out, "< ", cleft->left_start,
+		    cleft->left_count);
+		fprintf(info->out, "---\n");
+		print_lines(info->out, "> ", cright->right_start,
+		    cright->right_count);
 		return;
 	}
 
 	if (cleft) {
-		printf("%dd%d\n", cc->left.end, cc->right.start);
-		print_lines("< ", cleft->left_start, cleft->left_count);
+		fprintf(info->out, "%dd%d\n", cc->left.end, cc->right.start);
+		print_lines(info->out, "< ", cleft->left_start,
+		    cleft->left_count);
 	} else {
-		printf("%da%d\n", cc->left.start, cc->right.end);
-		print_lines("> ", cright->right_start, cright->right_count);
+		fprintf(info->out, "%da%d\n", cc->left.start, cc->right.end);
+		print_lines(info->out, "> ", cright->right_start,
+		    cright->right_count);
 	}
 }
 
 void
-print_context_before(const char *prefix, const struct diff_result *result,
-    const struct chunk_context *cc)
+print_context_before(FILE *out, const char *prefix,
+    const struct diff_result *result, const struct chunk_context *cc)
 {
 	const struct diff_chunk *chunk = &result->chunks.head[cc->chunk.start];
 	int start_line;
@@ -368,13 +528,13 @@ print_context_before(const char *prefix, const struct diff_result *result,
 	start_line = DD_ROOT_INDEX(&result->left, chunk->left_start);
 	if (cc->left.start >= start_line)
 		return;
-	print_lines(prefix, DD_ATOM_AT(&result->left, cc->left.start),
+	print_lines(out, prefix, DD_ATOM_AT(&result->left, cc->left.start),
 	    start_line - cc->left.start);
 }
 
 void
-print_context_after(const char *prefix, const struct diff_result *result,
-    const struct chunk_context *cc)
+print_context_after(FILE *out, const char *prefix,
+    const struct diff_result *result, const struct chunk_context *cc)
 {
 	const struct diff_chunk *chunk = &result->chunks.head[cc->chunk.end - 1];
 	int end_line;
@@ -383,7 +543,7 @@ print_context_after(const char *prefix, const struct diff_result *result,
 	    chunk->left_start + chunk->left_count);
 	if (cc->left.end <= end_line)
 		return;
-	print_lines(prefix, DD_ATOM_AT(&result->left, end_line),
+	print_lines(out, prefix, DD_ATOM_AT(&result->left, end_line),
 	    cc->left.end - end_line);
 }
 
@@ -396,13 +556,18 @@ print_unified(const struct diff_result *result, const struct output_info *info,
 	assert(info->format == F_UNIFIED);
 
 	if (!(*header_printed)) {
-		printf("--- %s\t%s+++ %s\t%s",
-		    info->left_path, ctime(&info->left_time),
-		    info->right_path, ctime(&info->right_time));
+		char lt[26], rt[26];
+
+		/* ctime_r(3): ctime(3)'s static buffer is not
+		 * thread-safe and the directory mode prints from
+		 * several workers. */
+		fprintf(info->out, "--- %s\t%s+++ %s\t%s",
+		    info->left_path, ctime_r(&info->left_time, lt),
+		    info->right_path, ctime_r(&info->right_time, rt));
 		*header_printed = true;
 	}
 
-	printf("@@ -%d,%d +%d,%d @@\n",
+	fprintf(info->out, "@@ -%d,%d +%d,%d @@\n",
 	    cc->left.start + 1, cc->left.end - cc->left.start,
 	    cc->right.start + 1, cc->right.end - cc->right.start);
 
@@ -414,7 +579,7 @@ print_unified(const struct diff_result *result, const struct output_info *info,
 	 * It is guaranteed to be only context lines where left == right,
 	 * so it suffices to look on the left.
 	 */
-	print_context_before(" ", result, cc);
+	print_context_before(info->out, " ", result, cc);
 
 	/* Now write out all the joined chunks and contexts between them */
 	for (c_idx = cc->chunk.start; c_idx < cc->chunk.end; c_idx++) {
@@ -423,23 +588,26 @@ print_unified(const struct diff_result *result, const struct output_info *info,
 		assert(c->solved);
 
 		if (c->left_count && c->right_count) {
-			print_lines(" ", c->left_start, c->left_count);
+			print_lines(info->out, " ", c->left_start,
+			    c->left_count);
 			continue;
 		}
 
 		if (c->left_count && !c->right_count) {
-			print_lines("-", c->left_start, c->left_count);
+			print_lines(info->out, "-", c->left_start,
+			    c->left_count);
 			continue;
 		}
 
 		if (c->right_count && !c->left_count) {
-			print_lines("+", c->right_start, c->right_count);
+			print_lines(info->out, "+", c->right_start,
+			    c->right_count);
 			continue;
 		}
 	}
 
 	/* Trailing context? */
-	print_context_after(" ", result, cc);
+	print_context_after(info->out, " ", result, cc);
 }
 
 static void
@@ -452,9 +620,11 @@ print_cformat(const struct diff_result *result, const struct output_info *info,
 	assert(info->format == F_CFORMAT);
 
 	if (!(*header_printed)) {
-		printf("*** %s\t%s--- %s\t%s",
-		    info->left_path, ctime(&info->left_time),
-		    info->right_path, ctime(&info->right_time));
+		char lt[26], rt[26];
+
+		fprintf(info->out, "*** %s\t%s--- %s\t%s",
+		    info->left_path, ctime_r(&info->left_time, lt),
+		    info->right_path, ctime_r(&info->right_time, rt));
 		*header_printed = true;
 	}
 
@@ -472,20 +642,22 @@ print_cformat(const struct diff_result *result, const struct output_info *info,
 		}
 	}
 
-	printf("***************\n");
-	printf("*** %d,%d ****\n", cc->left.start + 1, cc->left.end);
+	fprintf(info->out, "***************\n");
+	fprintf(info->out, "*** %d,%d ****\n", cc->left.start + 1,
+	    cc->left.end);
 	if (cleft != NULL) {
-		print_context_before("  ", result, cc);
-		print_lines(cright ? "! " : "- ",
+		print_context_before(info->out, "  ", result, cc);
+		print_lines(info->out, cright ? "! " : "- ",
 		    cleft->left_start, cleft->left_count);
-		print_context_after("  ", result, cc);
+		print_context_after(info->out, "  ", result, cc);
 	}
-	printf("--- %d,%d ----\n", cc->right.start + 1, cc->right.end);
+	fprintf(info->out, "--- %d,%d ----\n", cc->right.start + 1,
+	    cc->right.end);
 	if (cright != NULL) {
-		print_context_before("  ", result, cc);
-		print_lines(cleft ? "! " : "+ ",
+		print_context_before(info->out, "  ", result, cc);
+		print_lines(info->out, cleft ? "! " : "+ ",
 		    cright->right_start, cright->right_count);
-		print_context_after("  ", result, cc);
+		print_context_after(info->out, "  ", result, cc);
 	}
 }
 
@@ -567,3 +739,732 @@ output(const struct diff_result *result, const struct output_info *info)
 
 	print_chunk(result, info, &cc, &header_printed);
 }
+
+/*
+ * Persistent atomization cache (-S): next to a file F, a sidecar
+ * F.diffcache holds the header below followed by one record per atom.
+ * The sidecar is mmap-able: loading validates the header against the
+ * source file's size and mtime and materializes the atoms straight
+ * from the mapped records, skipping the line scan entirely.  The
+ * format is host-native; it is a cache, not an interchange format.
+ */
+#define ATOM_CACHE_MAGIC	"diffatom"
+#define ATOM_CACHE_VERSION	1
+
+struct atom_cache_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;		/* DIFF_FLAG_* the hashes were made with */
+	uint64_t src_size;
+	int64_t src_mtime;
+	uint64_t natoms;
+};
+
+struct atom_cache_rec {
+	uint64_t off;
+	uint64_t len;
+	uint32_t hash;
+	uint32_t pad;
+};
+
+static char *
+atom_cache_path(const char *path)
+{
+	char *cpath;
+
+	if (asprintf(&cpath, "%s.diffcache", path) == -1)
+		err(2, "asprintf");
+	return cpath;
+}
+
+/*
+ * Try to fill dd->atoms from the sidecar.  Returns 1 on a valid hit,
+ * 0 if there is no usable cache; any invalid sidecar is just a miss.
+ */
+static int
+atom_cache_load(const char *path, const struct stat *st,
+    struct diff_data *dd)
+{
+	const struct atom_cache_hdr *hdr;
+	const struct atom_cache_rec *rec;
+	struct diff_atom *atom;
+	struct stat cst;
+	char *cpath, *map;
+	uint64_t i;
+	int fd, ok = 0;
+
+	cpath = atom_cache_path(path);
+	fd = open(cpath, O_RDONLY);
+	free(cpath);
+	if (fd == -1)
+		return 0;
+	if (fstat(fd, &cst) == -1 || cst.st_size < sizeof(*hdr)) {
+		close(fd);
+		return 0;
+	}
+
+	map = mmap(NULL, cst.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+
+	hdr = (const struct atom_cache_hdr *)map;
+	if (memcmp(hdr->magic, ATOM_CACHE_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->version != ATOM_CACHE_VERSION ||
+	    hdr->flags != dd->flags ||
+	    hdr->src_size != (uint64_t)st->st_size ||
+	    hdr->src_mtime != (int64_t)st->st_mtime ||
+	    /*
+	     * Bound natoms by what actually fits in the sidecar before
+	     * multiplying, so a corrupt count cannot overflow the size
+	     * check and walk the loop below out of the mapping.
+	     */
+	    hdr->natoms > ((uint64_t)cst.st_size - sizeof(*hdr)) /
+	    sizeof(*rec) ||
+	    (uint64_t)cst.st_size != sizeof(*hdr) +
+	    hdr->natoms * sizeof(*rec) ||
+	    /* The pipeline indexes atoms with int; see the atomizers. */
+	    hdr->natoms > INT_MAX)
+		goto out;
+
+	ARRAYLIST_INIT(dd->atoms, 1024);
+	ARRAYLIST_RESERVE(dd->atoms, (unsigned int)hdr->natoms);
+	rec = (const struct atom_cache_rec *)(map + sizeof(*hdr));
+	for (i = 0; i < hdr->natoms; i++) {
+		/* A record pointing outside the file means corruption. */
+		if (rec[i].off > hdr->src_size ||
+		    rec[i].len > hdr->src_size - rec[i].off) {
+			ARRAYLIST_FREE(dd->atoms);
+			goto out;
+		}
+		ARRAYLIST_ADD(atom, dd->atoms);
+		if (atom == NULL) {
+			ARRAYLIST_FREE(dd->atoms);
+			goto out;
+		}
+		*atom = (struct diff_atom){
+			.at = dd->data + rec[i].off,
+			.len = rec[i].len,
+			.hash = rec[i].hash,
+		};
+	}
+	ok = 1;
+out:
+	munmap(map, cst.st_size);
+	return ok;
+}
+
+/*
+ * Write the sidecar for dd next to path.  Failures are silent: a cache
+ * that cannot be written only costs the next run the atomization.
+ */
+static void
+atom_cache_store(const char *path, const struct stat *st,
+    const struct diff_data *dd)
+{
+	struct atom_cache_hdr hdr;
+	struct atom_cache_rec rec;
+	char *cpath, *tpath;
+	FILE *f;
+	unsigned int i;
+
+	cpath = atom_cache_path(path);
+	if (asprintf(&tpath, "%s.tmp", cpath) == -1)
+		err(2, "asprintf");
+	f = fopen(tpath, "we");
+	if (f == NULL)
+		goto out;
+
+	hdr = (struct atom_cache_hdr){
+		.version = ATOM_CACHE_VERSION,
+		.flags = dd->flags,
+		.src_size = st->st_size,
+		.src_mtime = st->st_mtime,
+		.natoms = DD_ATOM_NB(dd),
+	};
+	memcpy(hdr.magic, ATOM_CACHE_MAGIC, sizeof(hdr.magic));
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+		goto out_unlink;
+	for (i = 0; i < DD_ATOM_NB(dd); i++) {
+		const struct diff_atom *atom = DD_ATOM_AT(dd, i);
+
+		rec = (struct atom_cache_rec){
+			.off = atom->at - dd->data,
+			.len = atom->len,
+			.hash = atom->hash,
+		};
+		if (fwrite(&rec, sizeof(rec), 1, f) != 1)
+			goto out_unlink;
+	}
+	if (fclose(f) == EOF) {
+		f = NULL;
+		goto out_unlink;
+	}
+	f = NULL;
+	if (rename(tpath, cpath) == -1)
+		unlink(tpath);
+	goto out;
+
+out_unlink:
+	if (f != NULL)
+		fclose(f);
+	unlink(tpath);
+out:
+	free(tpath);
+	free(cpath);
+}
+
+/*
+ * Prefetch pipeline: a helper thread walks both mappings touching one
+ * byte per page, so the page faults -- and the disk reads behind them
+ * -- happen ahead of and concurrently with the atomizer's scan
+ * instead of stalling it.  This overlaps I/O with compute even on one
+ * CPU, since the toucher spends its time blocked in the kernel.  The
+ * fast paths that answer without reading everything (e.g. the binary
+ * check) cancel the walk instead of waiting for it.
+ */
+struct prefetch {
+	pthread_t thread;
+	int started;
+	atomic_int cancel;
+	const char *bufs[2];
+	size_t lens[2];
+};
+
+#define PREFETCH_MIN	(16 * 1024 * 1024)
+
+static void *
+prefetch_worker(void *arg)
+{
+	struct prefetch *pf = arg;
+	volatile unsigned char sink = 0;
+	size_t i;
+	int b;
+
+	for (b = 0; b < 2; b++) {
+		for (i = 0; i < pf->lens[b]; i += 4096) {
+			/* Look for cancellation once per megabyte. */
+			if ((i & ((1u << 20) - 1)) == 0 &&
+			    atomic_load_explicit(&pf->cancel,
+			    memory_order_relaxed))
+				return NULL;
+			sink += (unsigned char)pf->bufs[b][i];
+		}
+	}
+	(void)sink;
+	return NULL;
+}
+
+static void
+prefetch_start(struct prefetch *pf, const char *lbuf, size_t llen,
+    const char *rbuf, size_t rlen)
+{
+	*pf = (struct prefetch){
+		.bufs = { lbuf, rbuf },
+		.lens = { llen, rlen },
+	};
+	if (llen + rlen < PREFETCH_MIN)
+		return;
+	if (pthread_create(&pf->thread, NULL, prefetch_worker, pf) == 0)
+		pf->started = 1;
+}
+
+static void
+prefetch_join(struct prefetch *pf)
+{
+	if (pf->started) {
+		atomic_store_explicit(&pf->cancel, 1, memory_order_relaxed);
+		pthread_join(pf->thread, NULL);
+	}
+	pf->started = 0;
+}
+
+/*
+ * Line-based diffing of binary data helps nobody; a NUL byte in the
+ * leading part of either input is the classic tell.
+ */
+static int
+buffer_is_binary(const char *buf, size_t len)
+{
+	/* Empty files have no mapping at all; memchr(NULL, ...) is UB. */
+	if (len == 0)
+		return 0;
+	return memchr(buf, '\0', MIN(len, (size_t)8192)) != NULL;
+}
+
+/*
+ * Report only whether the two buffers differ, stopping at the first
+ * difference.  Without -b a plain size check plus memcmp(3) does it;
+ * with -b the inputs are atomized and compared line by line under the
+ * blank-normalized equality, stopping at the first mismatching line.
+ */
+static int
+quick_differ(const struct output_info *info, const char *lbuf,
+    const struct stat *lsb, const char *rbuf, const struct stat *rsb)
+{
+	struct diff_data l = {}, r = {};
+	unsigned int i, n;
+	int differ = 0;
+
+	if (!info->ignore_blanks)
+		return lsb->st_size != rsb->st_size ||
+		    (lsb->st_size &&
+		    memcmp(lbuf, rbuf, lsb->st_size) != 0);
+
+	diff_data_init_root(&l, (const uint8_t *)lbuf, lsb->st_size);
+	diff_data_init_root(&r, (const uint8_t *)rbuf, rsb->st_size);
+	if (diff_atomize(&diff_config, &l, &r) != DIFF_RC_OK)
+		errx(2, "atomize failed");
+
+	n = MIN(DD_ATOM_NB(&l), DD_ATOM_NB(&r));
+	for (i = 0; i < n; i++) {
+		if (!diff_atom_same_flags(DD_ATOM_AT(&l, i),
+		    DD_ATOM_AT(&r, i), l.flags)) {
+			differ = 1;
+			break;
+		}
+	}
+	if (!differ)
+		differ = DD_ATOM_NB(&l) != DD_ATOM_NB(&r);
+
+	diff_data_free(&l);
+	diff_data_free(&r);
+	return differ;
+}
+
+/*
+ * Diff one pair of regular files into `out'.  In directory mode each
+ * differing file is announced with a "diff <flags> left right" line,
+ * like the recursive mode of the historical diff does.
+ */
+int
+diff_file_pair(const struct output_info *template, const char *flags,
+    const char *left_path, const char *right_path, FILE *out)
+{
+	struct output_info info = *template;
+	struct diff_result *result;
+	struct stat lsb, rsb;
+	char *lbuf, *rbuf;
+	int differ = 0, i;
+
+	info.left_path = left_path;
+	info.right_path = right_path;
+	info.out = out;
+
+	lbuf = mmapfile(left_path, &lsb);
+	rbuf = mmapfile(right_path, &rsb);
+	info.left_time = lsb.st_mtime;
+	info.right_time = rsb.st_mtime;
+
+	/*
+	 * -q answers from its own sequential read (or the size alone),
+	 * so warming the pages behind it would only add a full read of
+	 * both files; don't.
+	 */
+	struct prefetch pf = {};
+
+	if (!info.quick)
+		prefetch_start(&pf, lbuf, lsb.st_size, rbuf, rsb.st_size);
+
+	if (info.quick) {
+		differ = quick_differ(&info, lbuf, &lsb, rbuf, &rsb);
+		if (differ)
+			fprintf(out, "Files %s and %s differ\n",
+			    left_path, right_path);
+		prefetch_join(&pf);
+		if (lsb.st_size)
+			munmap(lbuf, lsb.st_size);
+		if (rsb.st_size)
+			munmap(rbuf, rsb.st_size);
+		return differ;
+	}
+
+	if (buffer_is_binary(lbuf, lsb.st_size) ||
+	    buffer_is_binary(rbuf, rsb.st_size)) {
+		differ = lsb.st_size != rsb.st_size ||
+		    (lsb.st_size && memcmp(lbuf, rbuf, lsb.st_size) != 0);
+		if (differ)
+			fprintf(out, "Binary files %s and %s differ\n",
+			    left_path, right_path);
+		prefetch_join(&pf);
+		if (lsb.st_size)
+			munmap(lbuf, lsb.st_size);
+		if (rsb.st_size)
+			munmap(rbuf, rsb.st_size);
+		return differ;
+	}
+
+	struct diff_data left_dd = {}, right_dd = {};
+
+	if (info.use_cache) {
+		int lhit, rhit;
+
+		diff_data_init_root(&left_dd, (uint8_t *)lbuf, lsb.st_size);
+		diff_data_init_root(&right_dd, (uint8_t *)rbuf, rsb.st_size);
+		left_dd.flags = diff_config.flags;
+		right_dd.flags = diff_config.flags;
+		lhit = atom_cache_load(left_path, &lsb, &left_dd);
+		rhit = atom_cache_load(right_path, &rsb, &right_dd);
+
+		/* Sides satisfied from the cache are left untouched. */
+		if (diff_atomize(&diff_config, &left_dd, &right_dd) !=
+		    DIFF_RC_OK)
+			errx(2, "atomize failed");
+		if (!lhit)
+			atom_cache_store(left_path, &lsb, &left_dd);
+		if (!rhit)
+			atom_cache_store(right_path, &rsb, &right_dd);
+
+		result = diff_main_prepared(&diff_config, &left_dd,
+		    &right_dd);
+	} else {
+		result = diff_main(&diff_config, lbuf, lsb.st_size, rbuf,
+		    rsb.st_size);
+	}
+	if (result == NULL || result->rc != DIFF_RC_OK)
+		errx(2, "%s / %s: diff failed", left_path, right_path);
+
+	for (i = 0; i < result->chunks.len; i++) {
+		enum chunk_type t = chunk_type(&result->chunks.head[i]);
+
+		if (t == CHUNK_MINUS || t == CHUNK_PLUS || t == CHUNK_WEIRD) {
+			differ = 1;
+			break;
+		}
+	}
+
+	if (differ) {
+		if (flags != NULL && *flags != '\0')
+			fprintf(out, "diff %s %s %s\n", flags,
+			    left_path, right_path);
+		else if (flags != NULL)
+			fprintf(out, "diff %s %s\n", left_path, right_path);
+		output(result, &info);
+	}
+
+	if (info.show_stats) {
+		const struct diff_stats *st = &result->stats;
+
+		fprintf(stderr, "atomize %.6fs  solve %.6fs  chunks %u\n",
+		    st->atomize_ns / 1e9, st->solve_ns / 1e9,
+		    result->chunks.len);
+		fprintf(stderr, "passes: myers %u  myers_divide %u"
+		    "  patience %u  histogram %u  none %u  fallbacks %u\n",
+		    st->myers_passes, st->myers_divide_passes,
+		    st->patience_passes, st->histogram_passes,
+		    st->none_passes, st->fallbacks);
+	}
+
+	diff_result_free(result);
+	diff_data_free(&left_dd);
+	diff_data_free(&right_dd);
+	prefetch_join(&pf);
+	if (lsb.st_size)
+		munmap(lbuf, lsb.st_size);
+	if (rsb.st_size)
+		munmap(rbuf, rsb.st_size);
+
+	return differ;
+}
+
+/*
+ * Batch mode (-B): read one 'left right' pair of paths per input line
+ * and diff each in turn, staying resident so process startup, malloc
+ * warmup and (with -S) the atomization cache amortize across many
+ * diffs.  Output is flushed after every pair so a driving process can
+ * stream the results.  A pair that cannot be stat'ed is reported and
+ * skipped rather than killing the batch.
+ */
+static int
+batch_mode(const struct output_info *info, const char *flags)
+{
+	struct stat sb;
+	char *line = NULL;
+	size_t linesize = 0;
+	ssize_t linelen;
+	int differ_any = 0;
+
+	while ((linelen = getline(&line, &linesize, stdin)) != -1) {
+		char *l, *r, *save;
+
+		if (linelen > 0 && line[linelen - 1] == '\n')
+			line[linelen - 1] = '\0';
+		l = strtok_r(line, " \t", &save);
+		if (l == NULL)
+			continue;	/* empty line */
+		r = strtok_r(NULL, " \t", &save);
+		if (r == NULL) {
+			warnx("batch: missing second path: %s", l);
+			continue;
+		}
+		if (stat(l, &sb) == -1) {
+			warn("%s", l);
+			continue;
+		}
+		if (stat(r, &sb) == -1) {
+			warn("%s", r);
+			continue;
+		}
+		differ_any |= diff_file_pair(info, flags, l, r, info->out);
+		fflush(info->out);
+	}
+	free(line);
+	return differ_any;
+}
+
+/*
+ * Sort directory entries in plain byte order: the lockstep merge below
+ * compares names with strcmp(3), so the sort must match it regardless
+ * of LC_COLLATE (which alphasort(3) would honor).
+ */
+static int
+scan_entcmp(const struct dirent **a, const struct dirent **b)
+{
+	return strcmp((*a)->d_name, (*b)->d_name);
+}
+
+/*
+ * Walk two directories in lockstep, collecting work units in sorted
+ * order: file pairs to diff, recursions into subdirectories present on
+ * both sides, and messages for entries present on one side only.
+ */
+static void
+scan_dirs(const char *ldir, const char *rdir,
+    struct dir_pair_arraylist *pairs)
+{
+	struct dirent **lents, **rents;
+	struct dir_pair *pair;
+	char lpath[PATH_MAX], rpath[PATH_MAX];
+	int nl, nr, i, j;
+
+	nl = scandir(ldir, &lents, NULL, scan_entcmp);
+	if (nl == -1)
+		err(2, "%s", ldir);
+	nr = scandir(rdir, &rents, NULL, scan_entcmp);
+	if (nr == -1)
+		err(2, "%s", rdir);
+
+	i = j = 0;
+	while (i < nl || j < nr) {
+		const char *lname = NULL, *rname = NULL;
+		struct stat lsb, rsb;
+		int cmp;
+
+		if (i < nl) {
+			lname = lents[i]->d_name;
+			if (strcmp(lname, ".") == 0 ||
+			    strcmp(lname, "..") == 0) {
+				i++;
+				continue;
+			}
+		}
+		if (j < nr) {
+			rname = rents[j]->d_name;
+			if (strcmp(rname, ".") == 0 ||
+			    strcmp(rname, "..") == 0) {
+				j++;
+				continue;
+			}
+		}
+
+		if (lname == NULL)
+			cmp = 1;
+		else if (rname == NULL)
+			cmp = -1;
+		else
+			cmp = strcmp(lname, rname);
+
+		ARRAYLIST_ADD(pair, *pairs);
+		if (pair == NULL)
+			errx(2, "out of memory");
+		*pair = (struct dir_pair){};
+
+		if (cmp < 0) {
+			if (asprintf(&pair->msg, "Only in %s: %s",
+			    ldir, lname) == -1)
+				err(2, "asprintf");
+			i++;
+			continue;
+		}
+		if (cmp > 0) {
+			if (asprintf(&pair->msg, "Only in %s: %s",
+			    rdir, rname) == -1)
+				err(2, "asprintf");
+			j++;
+			continue;
+		}
+
+		snprintf(lpath, sizeof(lpath), "%s/%s", ldir, lname);
+		snprintf(rpath, sizeof(rpath), "%s/%s", rdir, rname);
+		if (stat(lpath, &lsb) == -1)
+			err(2, "%s", lpath);
+		if (stat(rpath, &rsb) == -1)
+			err(2, "%s", rpath);
+
+		if (S_ISDIR(lsb.st_mode) && S_ISDIR(rsb.st_mode)) {
+			/* Reuse the slot for the common subdirectory. */
+			if (asprintf(&pair->msg, "Common subdirectories:"
+			    " %s and %s", lpath, rpath) == -1)
+				err(2, "asprintf");
+			scan_dirs(lpath, rpath, pairs);
+		} else if (S_ISREG(lsb.st_mode) && S_ISREG(rsb.st_mode)) {
+			pair->left = strdup(lpath);
+			pair->right = strdup(rpath);
+			if (pair->left == NULL || pair->right == NULL)
+				errx(2, "out of memory");
+		} else {
+			if (asprintf(&pair->msg, "File %s and %s are"
+			    " different types", lpath, rpath) == -1)
+				err(2, "asprintf");
+		}
+		i++;
+		j++;
+	}
+
+	for (i = 0; i < nl; i++)
+		free(lents[i]);
+	free(lents);
+	for (j = 0; j < nr; j++)
+		free(rents[j]);
+	free(rents);
+}
+
+/*
+ * Scheduler for the directory mode: worker threads pull the next file
+ * pair off a shared counter and render its diff into a memory buffer;
+ * the main thread prints the buffers in their original sorted order as
+ * they complete.
+ */
+struct dir_work {
+	struct dir_pair_arraylist *pairs;
+	const struct output_info *template;
+	const char *flags;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	unsigned int next;
+
+	char **bufs;
+	size_t *lens;
+	unsigned char *done;
+};
+
+static void
+dir_work_one(struct dir_work *work, unsigned int i, FILE *out)
+{
+	struct dir_pair *pair = &work->pairs->head[i];
+
+	if (pair->msg != NULL)
+		fprintf(out, "%s\n", pair->msg);
+	else
+		diff_file_pair(work->template, work->flags,
+		    pair->left, pair->right, out);
+}
+
+static void *
+dir_worker(void *arg)
+{
+	struct dir_work *work = arg;
+	FILE *out;
+	unsigned int i;
+
+	for (;;) {
+		pthread_mutex_lock(&work->mutex);
+		i = work->next++;
+		pthread_mutex_unlock(&work->mutex);
+		if (i >= work->pairs->len)
+			break;
+
+		out = open_memstream(&work->bufs[i], &work->lens[i]);
+		if (out == NULL)
+			err(2, "open_memstream");
+		dir_work_one(work, i, out);
+		fclose(out);
+
+		pthread_mutex_lock(&work->mutex);
+		work->done[i] = 1;
+		pthread_cond_broadcast(&work->cond);
+		pthread_mutex_unlock(&work->mutex);
+	}
+	return NULL;
+}
+
+static void
+diff_dirs(const char *ldir, const char *rdir, struct output_info *info,
+    const char *flags, unsigned int nthreads)
+{
+	struct dir_pair_arraylist pairs;
+	struct dir_work work;
+	pthread_t *threads = NULL;
+	unsigned int i, started = 0;
+
+	/*
+	 * Initialize the timezone state before any worker calls
+	 * ctime_r(3); the lazy first-use setup in libc is not
+	 * thread-safe everywhere.
+	 */
+	tzset();
+
+	ARRAYLIST_INIT(pairs, 128);
+	scan_dirs(ldir, rdir, &pairs);
+
+	if (nthreads > pairs.len)
+		nthreads = pairs.len;
+
+	if (nthreads <= 1) {
+		/* No point in buffering, render in order right away. */
+		for (i = 0; i < pairs.len; i++) {
+			struct dir_work seq = {
+				.pairs = &pairs,
+				.template = info,
+				.flags = flags,
+			};
+			dir_work_one(&seq, i, info->out);
+		}
+		return;
+	}
+
+	work = (struct dir_work) {
+		.pairs = &pairs,
+		.template = info,
+		.flags = flags,
+	};
+	pthread_mutex_init(&work.mutex, NULL);
+	pthread_cond_init(&work.cond, NULL);
+	work.bufs = calloc(pairs.len, sizeof(*work.bufs));
+	work.lens = calloc(pairs.len, sizeof(*work.lens));
+	work.done = calloc(pairs.len, sizeof(*work.done));
+	threads = calloc(nthreads, sizeof(*threads));
+	if (work.bufs == NULL || work.lens == NULL || work.done == NULL ||
+	    threads == NULL)
+		errx(2, "out of memory");
+
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, dir_worker,
+		    &work) != 0)
+			break;
+		started++;
+	}
+	if (started == 0) {
+		/* Thread spawn failed entirely; run it all here. */
+		dir_worker(&work);
+	}
+
+	/* Print each pair's buffer in order as it completes. */
+	for (i = 0; i < pairs.len; i++) {
+		pthread_mutex_lock(&work.mutex);
+		while (!work.done[i])
+			pthread_cond_wait(&work.cond, &work.mutex);
+		pthread_mutex_unlock(&work.mutex);
+
+		fwrite(work.bufs[i], 1, work.lens[i], info->out);
+		free(work.bufs[i]);
+	}
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	free(work.bufs);
+	free(work.lens);
+	free(work.done);
+}
@@ -18,6 +18,9 @@
 
 /* Split source by line breaks, and calculate a simplistic checksum. */
 
+#include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdint.h>
 
 #include "arraylist.h"
@@ -27,35 +30,99 @@ static int
 diff_data_atomize_text_lines(struct diff_data *dd)
 {
 	const uint8_t *pos = dd->data;
+
+	/*
+	 * A side that is already atomized is left untouched; this is
+	 * what lets callers reuse one side's atomization across several
+	 * runs, see diff_atomize().
+	 */
+	if (DD_ATOM_NB(dd))
+		return DIFF_RC_OK;
+
 	const uint8_t *end = pos + dd->dlen;
-	unsigned int array_size_estimate = dd->dlen / 50;
-	unsigned int pow2 = 1;
+	size_t array_size_estimate = dd->dlen / 50;
 
-	while (array_size_estimate >>= 1)
-		pow2++;
+	/*
+	 * Reserve the estimated final size up front, so the usual case
+	 * is a single allocation and geometric growth only kicks in
+	 * when the estimate was short.  Over-reserving is nearly free
+	 * -- the zeroed pages are only materialized as they are
+	 * touched -- while growing a huge array step by step would
+	 * copy gigabytes around on multi-GB inputs.  The estimate is a
+	 * size_t so files beyond 4 GB don't truncate it.
+	 */
+	if (array_size_estimate < 1024)
+		array_size_estimate = 1024;
+	else if (array_size_estimate > (1u << 30))
+		array_size_estimate = 1u << 30;
 
-	ARRAYLIST_INIT(dd->atoms, 1 << pow2);
+	ARRAYLIST_INIT(dd->atoms, 1024);
+	ARRAYLIST_RESERVE(dd->atoms, (unsigned int)array_size_estimate);
 
 	while (pos < end) {
-		const uint8_t *line_end = pos;
+		const uint8_t *line_end, *cr, *p;
 		unsigned int hash = 0;
 		struct diff_atom *atom;
+		bool pending_blank = false;
 
-		while (line_end < end &&
-		    *line_end != '\r' && *line_end != '\n') {
-			hash = hash * 23 + *line_end;
-			line_end++;
+		/*
+		 * Find the end of the line with memchr(3) instead of
+		 * inspecting one byte at a time; libc's memchr runs at
+		 * SIMD throughput on all platforms that matter.  A line
+		 * is terminated by '\n', by "\r\n" or by a lone '\r'.
+		 */
+		line_end = memchr(pos, '\n', end - pos);
+		if (line_end == NULL)
+			line_end = end;
+		cr = memchr(pos, '\r', line_end - pos);
+		if (cr != NULL)
+			line_end = cr;
+
+		/*
+		 * Checksum the line content in a tight loop of its own,
+		 * now that the line length is already known.  When
+		 * whitespace is to be ignored, checksum the normalized
+		 * line instead: blank runs count as a single space and
+		 * trailing blanks not at all, so lines equal under -b
+		 * get equal hashes.
+		 */
+		if (dd->flags & DIFF_FLAG_IGNORE_WHITESPACE) {
+			for (p = pos; p < line_end; p++) {
+				if (*p == ' ' || *p == '\t') {
+					pending_blank = true;
+					continue;
+				}
+				if (pending_blank) {
+					hash = hash * 23 + ' ';
+					pending_blank = false;
+				}
+				hash = hash * 23 + *p;
+			}
+		} else {
+			for (p = pos; p < line_end; p++)
+				hash = hash * 23 + *p;
 		}
 
 		/*
-		 * When not at the end of data, the line ending char ('\r'
-		 * or '\n') must follow
+		 * When not at the end of data, the line ending char
+		 * ('\r' or '\n') must follow; an '\r' pulls in any
+		 * directly following '\n' as well.
 		 */
-		if (line_end < end)
-			line_end++;
-		/* If that was an '\r', also pull in any following '\n' */
-		if (line_end[0] == '\r' && line_end < end && line_end[1] == '\n')
+		if (line_end < end) {
+			if (*line_end == '\r' && line_end + 1 < end &&
+			    line_end[1] == '\n')
+				line_end++;
 			line_end++;
+		}
+
+		/*
+		 * Chunk walks, ranges and the Myers arithmetic index
+		 * with plain int; refuse inputs with more lines than
+		 * INT_MAX rather than letting those overflow into
+		 * garbage downstream.
+		 */
+		if (DD_ATOM_NB(dd) == INT_MAX)
+			return DIFF_RC_ENOTSUP;
 
 		/* Record the found line as diff atom */
 		ARRAYLIST_ADD(atom, dd->atoms);
@@ -86,3 +153,111 @@ diff_atomize_text_by_line(void *func_data, struct diff_data *left,
 		return rc;
 	return diff_data_atomize_text_lines(right);
 }
+
+/*
+ * Split source into word-level tokens: a run of alphanumerics (and
+ * underscores), a run of blanks, or a single other byte each form one
+ * atom.  Meant for re-diffing the changed lines of a hunk at a finer
+ * granularity; see diff_refine_chunk_pair().
+ */
+static int
+diff_data_atomize_text_tokens(struct diff_data *dd)
+{
+	const uint8_t *pos = dd->data;
+	const uint8_t *end = pos + dd->dlen;
+	size_t array_size_estimate = dd->dlen / 4;
+
+	if (DD_ATOM_NB(dd))
+		return DIFF_RC_OK;
+
+	if (array_size_estimate < 1024)
+		array_size_estimate = 1024;
+	else if (array_size_estimate > (1u << 30))
+		array_size_estimate = 1u << 30;
+
+	ARRAYLIST_INIT(dd->atoms, 1024);
+	ARRAYLIST_RESERVE(dd->atoms, (unsigned int)array_size_estimate);
+
+	while (pos < end) {
+		const uint8_t *tok_end, *p;
+		unsigned int hash = 0;
+		struct diff_atom *atom;
+
+		if (isalnum(*pos) || *pos == '_') {
+			tok_end = pos;
+			while (tok_end < end &&
+			    (isalnum(*tok_end) || *tok_end == '_'))
+				tok_end++;
+		} else if (*pos == ' ' || *pos == '\t') {
+			tok_end = pos;
+			while (tok_end < end &&
+			    (*tok_end == ' ' || *tok_end == '\t'))
+				tok_end++;
+		} else
+			tok_end = pos + 1;
+
+		for (p = pos; p < tok_end; p++)
+			hash = hash * 23 + *p;
+
+		if (DD_ATOM_NB(dd) == INT_MAX)
+			return DIFF_RC_ENOTSUP;
+		ARRAYLIST_ADD(atom, dd->atoms);
+		if (atom == NULL)
+			return DIFF_RC_ENOMEM;
+		*atom = (struct diff_atom){
+			.at = pos,
+			.len = tok_end - pos,
+			.hash = hash,
+		};
+		pos = tok_end;
+	}
+
+	return DIFF_RC_OK;
+}
+
+enum diff_rc
+diff_atomize_text_by_token(void *func_data, struct diff_data *left,
+    struct diff_data *right)
+{
+	enum diff_rc rc;
+
+	rc = diff_data_atomize_text_tokens(left);
+	if (rc != DIFF_RC_OK)
+		return rc;
+	return diff_data_atomize_text_tokens(right);
+}
+
+static void *
+diff_atomize_text_lines_worker(void *arg)
+{
+	return (void *)(intptr_t)diff_data_atomize_text_lines(arg);
+}
+
+/*
+ * Variant of diff_atomize_text_by_line() that atomizes both sides
+ * concurrently; the two diff_data are completely independent.  Only
+ * pays off for sizable inputs, so small ones take the sequential path,
+ * as does any failure to spawn the worker thread.
+ */
+#define DIFF_ATOMIZE_PARALLEL_MIN	(4 * 1024 * 1024)
+
+enum diff_rc
+diff_atomize_text_by_line_parallel(void *func_data, struct diff_data *left,
+    struct diff_data *right)
+{
+	pthread_t thread;
+	void *thread_rc;
+	enum diff_rc rc;
+
+	if (left->dlen < DIFF_ATOMIZE_PARALLEL_MIN ||
+	    right->dlen < DIFF_ATOMIZE_PARALLEL_MIN ||
+	    pthread_create(&thread, NULL, diff_atomize_text_lines_worker,
+	    left) != 0)
+		return diff_atomize_text_by_line(func_data, left, right);
+
+	rc = diff_data_atomize_text_lines(right);
+	pthread_join(thread, &thread_rc);
+	if (rc != DIFF_RC_OK)
+		return rc;
+	return (enum diff_rc)(intptr_t)thread_rc;
+}
@@ -0,0 +1,260 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Copyright (c) 2018,2020 Martin Pieuchot <mpi@openbsd.org>
+ * Copyright (c) 2020 Neels Hofmeyr <neels@hofmeyr.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Benchmark harness for the diff implementations: run a diff repeatedly
+ * and report wall times for each stage -- atomize, solve and output --
+ * plus the peak memory use, so algorithm configurations can be rated
+ * against each other.  -A selects the algorithm chain like diff(1)
+ * does; the output stage renders every chunk into /dev/null.
+ */
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "diff_main.h"
+
+const struct diff_algo_config myers, patience, myers_divide, histogram;
+
+const struct diff_algo_config myers = {
+	.impl = diff_algo_myers,
+	.permitted_state_size = 1024 * 1024 * sizeof(int),
+	.fallback_algo = &patience,
+};
+
+const struct diff_algo_config patience = {
+	.impl = diff_algo_patience,
+	.inner_algo = &patience,
+	.fallback_algo = &myers_divide,
+};
+
+const struct diff_algo_config myers_divide = {
+	.impl = diff_algo_myers_divide,
+	.inner_algo = &myers,
+	.fallback_algo = NULL,
+};
+
+const struct diff_algo_config histogram = {
+	.impl = diff_algo_histogram,
+	.inner_algo = &histogram,
+	.fallback_algo = &myers_divide,
+};
+
+struct diff_config diff_config = {
+	.atomize_func = diff_atomize_text_by_line,
+	.algo = &myers,
+};
+
+__dead static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-n iterations] [-A algo] file1 file2\n",
+	    getprogname());
+	exit(1);
+}
+
+/*
+ * A representative output pass: render every chunk with its unidiff
+ * line prefix.  Writing to /dev/null keeps the timing about the
+ * rendering work, not the sink.
+ */
+static void
+render_result(const struct diff_result *result, FILE *out)
+{
+	const struct diff_atom *a;
+	int i;
+
+	for (i = 0; i < result->chunks.len; i++) {
+		const struct diff_chunk *c = &result->chunks.head[i];
+
+		if (c->left_count && c->right_count) {
+			for (a = c->left_start;
+			    a < c->left_start + c->left_count; a++) {
+				putc(' ', out);
+				fwrite(a->at, 1, a->len, out);
+			}
+			continue;
+		}
+		for (a = c->left_start; c->left_count &&
+		    a < c->left_start + c->left_count; a++) {
+			putc('-', out);
+			fwrite(a->at, 1, a->len, out);
+		}
+		for (a = c->right_start; c->right_count &&
+		    a < c->right_start + c->right_count; a++) {
+			putc('+', out);
+			fwrite(a->at, 1, a->len, out);
+		}
+	}
+}
+
+static char *
+mmapfile(const char *path, struct stat *st)
+{
+	int	 fd;
+	char	*p;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		err(2, "%s", path);
+
+	if (fstat(fd, st) == -1)
+		err(2, "%s", path);
+
+	p = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED)
+		err(2, "mmap");
+
+	close(fd);
+
+	return p;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct diff_result *result = NULL;
+	struct diff_data left, right;
+	struct rusage ru;
+	struct stat lsb, rsb;
+	FILE *sink;
+	char *ep, *lbuf, *rbuf;
+	double t, atomize_min, total_min, output_min;
+	unsigned int chunks = 0;
+	long iterations = 5;
+	int ch, i;
+
+	while ((ch = getopt(argc, argv, "A:n:")) != -1) {
+		switch (ch) {
+		case 'A':
+			if (strcmp(optarg, "myers") == 0)
+				diff_config.algo = &myers;
+			else if (strcmp(optarg, "patience") == 0)
+				diff_config.algo = &patience;
+			else if (strcmp(optarg, "histogram") == 0)
+				diff_config.algo = &histogram;
+			else
+				usage();
+			break;
+		case 'n':
+			iterations = strtol(optarg, &ep, 10);
+			if (*ep != '\0' || iterations < 1 ||
+			    iterations >= INT_MAX)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 2)
+		usage();
+
+	lbuf = mmapfile(argv[0], &lsb);
+	rbuf = mmapfile(argv[1], &rsb);
+
+	sink = fopen("/dev/null", "w");
+	if (sink == NULL)
+		err(2, "/dev/null");
+
+	atomize_min = total_min = output_min = -1;
+	for (i = 0; i < iterations; i++) {
+		/* Atomization alone. */
+		diff_data_init_root(&left, lbuf, lsb.st_size);
+		diff_data_init_root(&right, rbuf, rsb.st_size);
+		t = now();
+		if (diff_atomize_text_by_line(NULL, &left, &right) !=
+		    DIFF_RC_OK)
+			errx(1, "atomize failed");
+		t = now() - t;
+		if (atomize_min < 0 || t < atomize_min)
+			atomize_min = t;
+		diff_data_free(&left);
+		diff_data_free(&right);
+
+		/* The full pipeline. */
+		t = now();
+		result = diff_main(&diff_config, lbuf, lsb.st_size,
+		    rbuf, rsb.st_size);
+		t = now() - t;
+		if (result == NULL || result->rc != DIFF_RC_OK)
+			errx(1, "diff failed");
+		if (total_min < 0 || t < total_min)
+			total_min = t;
+		chunks = result->chunks.len;
+
+		/* The output stage. */
+		t = now();
+		render_result(result, sink);
+		fflush(sink);
+		t = now() - t;
+		if (output_min < 0 || t < output_min)
+			output_min = t;
+
+		if (i < iterations - 1) {
+			diff_result_free(result);
+			result = NULL;
+		}
+	}
+
+	printf("%s %s: %ld iterations, best of:\n", argv[0], argv[1],
+	    iterations);
+	printf("  atomize  %9.6fs\n", atomize_min);
+	printf("  solve    %9.6fs  (last run, from diff_stats)\n",
+	    result->stats.solve_ns / 1e9);
+	printf("  output   %9.6fs\n", output_min);
+	printf("  total    %9.6fs  (atomize + solve)\n", total_min);
+	printf("  chunks   %u\n", chunks);
+	if (getrusage(RUSAGE_SELF, &ru) == 0)
+		printf("  max rss  %ld KB\n", (long)ru.ru_maxrss);
+	printf("  passes   myers %u  myers_divide %u  patience %u"
+	    "  histogram %u  none %u  fallbacks %u\n",
+	    result->stats.myers_passes, result->stats.myers_divide_passes,
+	    result->stats.patience_passes, result->stats.histogram_passes,
+	    result->stats.none_passes, result->stats.fallbacks);
+
+	diff_result_free(result);
+	fclose(sink);
+	munmap(lbuf, lsb.st_size);
+	munmap(rbuf, rsb.st_size);
+
+	return 0;
+}
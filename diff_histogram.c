@@ -0,0 +1,232 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Copyright (c) 2020 Neels Hofmeyr <neels@hofmeyr.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Histogram Diff, in the spirit of JGit's HistogramDiff: split the
+ * problem at the rarest line that appears on both sides, around the
+ * longest run of identical lines containing it, and recurse on the
+ * sections before and after.  Like Patience Diff it is a divider, but
+ * it can anchor on lines that are rare rather than strictly unique.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "diff_main.h"
+#include "debug.h"
+
+/*
+ * Lines more frequent than this make poor anchors; if nothing rarer is
+ * common to both sides, let the fallback algorithm take over.
+ */
+#define HISTOGRAM_MAX_OCCURRENCES	64
+
+/*
+ * Occurrence counts per atom id, in an open-addressing table sized to
+ * the subsection at hand.  Atom ids are global to the whole diff, so
+ * plain arrays indexed by id would cost O(all distinct lines) to clear
+ * on every recursive pass over a tiny subsection.
+ */
+struct histogram_entry {
+	unsigned int id;		/* zero marks an empty slot */
+	unsigned int left_count;
+	unsigned int right_count;
+	unsigned int left_pos;
+};
+
+/*
+ * With mask == 0 the table is dense, indexed by id directly; otherwise
+ * it is an open-addressing hash table of mask + 1 slots.
+ */
+static inline struct histogram_entry *
+histogram_entry_get(struct histogram_entry *table, unsigned int mask,
+    unsigned int id)
+{
+	unsigned int slot;
+
+	if (mask == 0)
+		return &table[id];
+
+	slot = (id * 2654435761u) & mask;
+	while (table[slot].id != 0 && table[slot].id != id)
+		slot = (slot + 1) & mask;
+	table[slot].id = id;
+	return &table[slot];
+}
+
+enum diff_rc
+diff_algo_histogram(const struct diff_algo_config *algo_config,
+    struct diff_state *state)
+{
+	struct diff_data *left = &state->left;
+	struct diff_data *right = &state->right;
+	struct diff_arena *arena = &state->result->arena;
+	struct diff_arena_mark mark;
+	struct diff_atom *atom;
+	struct histogram_entry *table, *e;
+	unsigned int natoms, nslots = 4, mask, max_id = 0, best_score = 0;
+	unsigned int l_idx = 0, r_idx = 0;
+	bool have_anchor = false;
+	struct range run_l, run_r;
+
+	debug("\n** %s\n", __func__);
+
+	state->result->stats.histogram_passes++;
+
+	/*
+	 * The occurrence counting below is keyed by the interned atom
+	 * ids; without interning there is nothing cheap to count by.
+	 */
+	DD_ATOM_FOREACH(atom, left, 0) {
+		if (atom->id == 0)
+			return DIFF_RC_USE_DIFF_ALGO_FALLBACK;
+		max_id = MAX(max_id, atom->id);
+	}
+	DD_ATOM_FOREACH(atom, right, 0) {
+		if (atom->id == 0)
+			return DIFF_RC_USE_DIFF_ALGO_FALLBACK;
+		max_id = MAX(max_id, atom->id);
+	}
+
+	/*
+	 * Atom ids are global to the whole diff.  When the id space is
+	 * of the same order as this subsection, a dense table indexed by
+	 * id is both smaller to clear and free of cache-hostile probing;
+	 * for a small subsection of a huge diff, fall back to a hash
+	 * table sized to the subsection instead.
+	 */
+	natoms = DD_ATOM_NB(left) + DD_ATOM_NB(right);
+	if (max_id <= natoms * 4) {
+		nslots = max_id + 1;
+		mask = 0;
+	} else {
+		while (nslots < natoms * 2 && nslots < (1u << 31))
+			nslots <<= 1;
+		mask = nslots - 1;
+	}
+
+	diff_arena_mark(arena, &mark);
+	table = diff_arena_alloc(arena, nslots, sizeof(*table));
+	if (table == NULL) {
+		diff_arena_release(arena, &mark);
+		return DIFF_RC_ENOMEM;
+	}
+
+	DD_ATOM_FOREACH(atom, left, 0) {
+		e = histogram_entry_get(table, mask, atom->id);
+		if (e->left_count++ == 0)
+			e->left_pos = DD_ATOM_INDEX(left, atom);
+	}
+	DD_ATOM_FOREACH(atom, right, 0)
+		histogram_entry_get(table, mask, atom->id)->right_count++;
+
+	/*
+	 * Pick the rarest line present on both sides as the anchor,
+	 * scored by its total number of occurrences.
+	 */
+	DD_ATOM_FOREACH(atom, right, 0) {
+		unsigned int score;
+
+		e = histogram_entry_get(table, mask, atom->id);
+		if (e->left_count == 0 ||
+		    e->left_count > HISTOGRAM_MAX_OCCURRENCES)
+			continue;
+		score = e->left_count + e->right_count;
+		if (!have_anchor || score < best_score) {
+			have_anchor = true;
+			best_score = score;
+			l_idx = e->left_pos;
+			r_idx = DD_ATOM_INDEX(right, atom);
+		}
+	}
+	diff_arena_release(arena, &mark);
+
+	if (!have_anchor) {
+		/* No usable common line, try the fallback_algo. */
+		return DIFF_RC_USE_DIFF_ALGO_FALLBACK;
+	}
+
+	debug("histogram anchor l=%u r=%u score=%u\n", l_idx, r_idx,
+	    best_score);
+
+	/* Expand the run of identical lines around the anchor. */
+	run_l = (struct range){ .start = l_idx, .end = l_idx + 1 };
+	run_r = (struct range){ .start = r_idx, .end = r_idx + 1 };
+	while (run_l.start > 0 && run_r.start > 0 &&
+	    diff_atom_same(DD_ATOM_AT(left, run_l.start - 1),
+	    DD_ATOM_AT(right, run_r.start - 1))) {
+		run_l.start--;
+		run_r.start--;
+	}
+	while (run_l.end < DD_ATOM_NB(left) &&
+	    run_r.end < DD_ATOM_NB(right) &&
+	    diff_atom_same(DD_ATOM_AT(left, run_l.end),
+	    DD_ATOM_AT(right, run_r.end))) {
+		run_l.end++;
+		run_r.end++;
+	}
+
+	/* Section before the run. */
+	if (run_l.start && run_r.start) {
+		if (!diff_state_add_chunk(state, false,
+		    DD_ATOM_AT(left, 0), run_l.start,
+		    DD_ATOM_AT(right, 0), run_r.start))
+			return DIFF_RC_ENOMEM;
+	} else if (run_l.start) {
+		if (!diff_state_add_chunk(state, true,
+		    DD_ATOM_AT(left, 0), run_l.start,
+		    DD_ATOM_AT(right, 0), 0))
+			return DIFF_RC_ENOMEM;
+	} else if (run_r.start) {
+		if (!diff_state_add_chunk(state, true,
+		    DD_ATOM_AT(left, 0), 0,
+		    DD_ATOM_AT(right, 0), run_r.start))
+			return DIFF_RC_ENOMEM;
+	}
+
+	/* The identical run itself. */
+	if (!diff_state_add_chunk(state, true,
+	    DD_ATOM_AT(left, run_l.start), range_len(&run_l),
+	    DD_ATOM_AT(right, run_r.start), range_len(&run_r)))
+		return DIFF_RC_ENOMEM;
+
+	/* Section after the run. */
+	if (run_l.end < DD_ATOM_NB(left) && run_r.end < DD_ATOM_NB(right)) {
+		if (!diff_state_add_chunk(state, false,
+		    DD_ATOM_AT(left, run_l.end),
+		    DD_ATOM_NB(left) - run_l.end,
+		    DD_ATOM_AT(right, run_r.end),
+		    DD_ATOM_NB(right) - run_r.end))
+			return DIFF_RC_ENOMEM;
+	} else if (run_l.end < DD_ATOM_NB(left)) {
+		if (!diff_state_add_chunk(state, true,
+		    DD_ATOM_AT(left, run_l.end),
+		    DD_ATOM_NB(left) - run_l.end,
+		    DD_ATOM_AT(right, run_r.end), 0))
+			return DIFF_RC_ENOMEM;
+	} else if (run_r.end < DD_ATOM_NB(right)) {
+		if (!diff_state_add_chunk(state, true,
+		    DD_ATOM_AT(left, run_l.end), 0,
+		    DD_ATOM_AT(right, run_r.end),
+		    DD_ATOM_NB(right) - run_r.end))
+			return DIFF_RC_ENOMEM;
+	}
+
+	debug("** END %s\n", __func__);
+	return DIFF_RC_OK;
+}
@@ -20,21 +20,299 @@
  * Generic infrastructure to implement various diff algorithms (implementation).
  */
 
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <time.h>
 
 #include "arraylist.h"
 #include "diff_main.h"
 #include "debug.h"
 
+enum diff_rc diff_run_algo(const struct diff_algo_config *algo_config,
+    struct diff_state *state);
+
+static uint64_t
+diff_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#define DIFF_ARENA_BLOCK_MIN	(1024 * 1024)
+#define DIFF_ARENA_ALIGN	8
+
+struct diff_arena_block {
+	struct diff_arena_block *prev;
+	size_t size;
+	size_t used;
+};
+
+void *
+diff_arena_alloc(struct diff_arena *arena, size_t nmemb, size_t size)
+{
+	struct diff_arena_block *b = arena->block;
+	size_t len;
+	void *p;
+
+	if (size && nmemb > SIZE_MAX / size)
+		return NULL;
+	len = nmemb * size;
+
+	if (b == NULL || b->size - b->used < len) {
+		size_t bsize = MAX(len, DIFF_ARENA_BLOCK_MIN);
+
+		if (bsize > SIZE_MAX - sizeof(*b))
+			return NULL;
+		b = malloc(sizeof(*b) + bsize);
+		if (b == NULL)
+			return NULL;
+		b->prev = arena->block;
+		b->size = bsize;
+		b->used = 0;
+		arena->block = b;
+	}
+
+	p = (char *)(b + 1) + b->used;
+	b->used += (len + DIFF_ARENA_ALIGN - 1) &
+	    ~(size_t)(DIFF_ARENA_ALIGN - 1);
+	if (b->used > b->size)
+		b->used = b->size;
+	memset(p, 0, len);
+	return p;
+}
+
+void
+diff_arena_mark(struct diff_arena *arena, struct diff_arena_mark *mark)
+{
+	mark->block = arena->block;
+	mark->used = arena->block ? arena->block->used : 0;
+}
+
+void
+diff_arena_release(struct diff_arena *arena, const struct diff_arena_mark *mark)
+{
+	struct diff_arena_block *b;
+
+	while ((b = arena->block) != mark->block) {
+		arena->block = b->prev;
+		free(b);
+	}
+	if (arena->block)
+		arena->block->used = mark->used;
+}
+
+void
+diff_arena_free(struct diff_arena *arena)
+{
+	struct diff_arena_mark mark = {};
+
+	diff_arena_release(arena, &mark);
+}
+
+/*
+ * Yield the next character of an atom in its whitespace-normalized
+ * form: runs of blanks collapse into a single space, a trailing run
+ * (directly before the line terminator, or the end) disappears.
+ * Returns -1 at the end of the atom.
+ */
+static inline int
+diff_atom_next_canon_byte(const uint8_t *s, size_t len, size_t *i)
+{
+	size_t j;
+
+	if (*i < len && (s[*i] == ' ' || s[*i] == '\t')) {
+		j = *i;
+		while (j < len && (s[j] == ' ' || s[j] == '\t'))
+			j++;
+		*i = j;
+		if (j < len && s[j] != '\n' && s[j] != '\r')
+			return ' ';
+		/* A trailing run; fall through to what follows it. */
+	}
+	if (*i >= len)
+		return -1;
+	return s[(*i)++];
+}
+
+/* Compare two atoms with diff(1) -b semantics. */
+static bool
+diff_atom_same_ignore_whitespace(const struct diff_atom *left,
+    const struct diff_atom *right)
+{
+	size_t li = 0, ri = 0;
+	int lc, rc;
+
+	do {
+		lc = diff_atom_next_canon_byte(left->at, left->len, &li);
+		rc = diff_atom_next_canon_byte(right->at, right->len, &ri);
+		if (lc != rc)
+			return false;
+	} while (lc != -1);
+	return true;
+}
+
+/*
+ * The content comparison the current run calls for: exact bytes, or
+ * whitespace-normalized under DIFF_FLAG_IGNORE_WHITESPACE.
+ */
+bool
+diff_atom_same_flags(const struct diff_atom *left,
+    const struct diff_atom *right, unsigned int flags)
+{
+	if (flags & DIFF_FLAG_IGNORE_WHITESPACE) {
+		if (left->hash != right->hash)
+			return false;
+		return diff_atom_same_ignore_whitespace(left, right);
+	}
+	return diff_atom_same_content(left, right);
+}
+
+/*
+ * Map every distinct atom content to a nonzero integer id, shared
+ * across the two sides of the result, so that diff_atom_same() turns
+ * into a single integer compare for the rest of the pipeline.  The
+ * interning table is transient and comes from the arena.
+ */
+struct diff_intern_entry {
+	struct diff_atom *atom;
+	struct diff_intern_entry *next;
+};
+
+static enum diff_rc
+diff_atoms_intern(struct diff_result *result,
+    struct diff_atom *left_from, unsigned int left_count,
+    struct diff_atom *right_from, unsigned int right_count)
+{
+	struct diff_arena *arena = &result->arena;
+	struct diff_arena_mark mark;
+	struct diff_intern_entry **buckets, *e;
+	struct diff_atom *ranges[2] = { left_from, right_from };
+	unsigned int counts[2] = { left_count, right_count };
+	struct diff_atom *atom;
+	unsigned int nbuckets = 4, natoms, next_id = 1, pool_used = 0;
+	unsigned int flags = result->left.flags;
+	struct diff_intern_entry *pool;
+	int side;
+
+	natoms = left_count + right_count;
+	while (nbuckets < natoms * 2 && nbuckets < (1u << 31))
+		nbuckets <<= 1;
+
+	diff_arena_mark(arena, &mark);
+	buckets = diff_arena_alloc(arena, nbuckets, sizeof(*buckets));
+	pool = diff_arena_alloc(arena, natoms, sizeof(*pool));
+	if (buckets == NULL || pool == NULL) {
+		diff_arena_release(arena, &mark);
+		return DIFF_RC_ENOMEM;
+	}
+
+	for (side = 0; side < 2; side++) {
+		foreach_diff_atom(atom, ranges[side], counts[side]) {
+			unsigned int b =
+			    (atom->hash * 2654435761u) & (nbuckets - 1);
+
+			for (e = buckets[b]; e != NULL; e = e->next) {
+				if (diff_atom_same_flags(e->atom,
+				    atom, flags))
+					break;
+			}
+			if (e != NULL) {
+				atom->id = e->atom->id;
+				continue;
+			}
+			atom->id = next_id++;
+			e = &pool[pool_used++];
+			e->atom = atom;
+			e->next = buckets[b];
+			buckets[b] = e;
+		}
+	}
+
+	diff_arena_release(arena, &mark);
+	return DIFF_RC_OK;
+}
+
 /*
  * Even if a left or right side is empty, diff output may need to know the
  * position in that file.  So left_start or right_start must never be NULL
  * -- pass left_count or right_count as zero to indicate staying at that
  * position without consuming any lines.
  */
+/*
+ * Pass finalized chunks to the configured streaming callback.  A chunk
+ * is final once another chunk follows it -- the coalescing in
+ * diff_chunk_list_append() may still extend the last one -- or when
+ * the whole solve is done.
+ */
+static enum diff_rc
+diff_stream_chunks(struct diff_state *state, bool solve_done)
+{
+	struct diff_result *result = state->result;
+	unsigned int until;
+	enum diff_rc rc;
+
+	if (state->chunk_cb == NULL)
+		return DIFF_RC_OK;
+
+	until = result->chunks.len;
+	if (!solve_done && until > 0)
+		until--;
+	while (result->chunks_streamed < until) {
+		rc = state->chunk_cb(
+		    &result->chunks.head[result->chunks_streamed],
+		    state->chunk_cb_data);
+		if (rc != DIFF_RC_OK) {
+			result->stream_abort_rc = rc;
+			return rc;
+		}
+		result->chunks_streamed++;
+	}
+	return DIFF_RC_OK;
+}
+
+/* Does a chunk side starting at `_s' directly follow `_ps' + `_pc'? */
+#define CHUNK_SIDE_ADJACENT(_ps, _pc, _s) \
+	((_pc) ? (_ps) + (_pc) == (_s) : (_ps) == (_s))
+
+/*
+ * Append a solved chunk to a chunk list, extending the last entry
+ * instead when the new chunk is of the same type and directly adjoins
+ * it on both sides.  Returns NULL on allocation failure.
+ */
+static struct diff_chunk *
+diff_chunk_list_append(struct diff_chunk_arraylist *list,
+    const struct diff_chunk *c)
+{
+	struct diff_chunk *chunk;
+
+	if (list->len) {
+		struct diff_chunk *prev = &list->head[list->len - 1];
+
+		if (prev->solved && c->solved &&
+		    !prev->left_count == !c->left_count &&
+		    !prev->right_count == !c->right_count &&
+		    CHUNK_SIDE_ADJACENT(prev->left_start, prev->left_count,
+		    c->left_start) &&
+		    CHUNK_SIDE_ADJACENT(prev->right_start, prev->right_count,
+		    c->right_start)) {
+			prev->left_count += c->left_count;
+			prev->right_count += c->right_count;
+			return prev;
+		}
+	}
+
+	ARRAYLIST_ADD(chunk, *list);
+	if (chunk == NULL)
+		return NULL;
+	*chunk = *c;
+	return chunk;
+}
+
 struct diff_chunk *
 diff_state_add_chunk(struct diff_state *state, bool solved,
     struct diff_atom *left_start, unsigned int left_count,
@@ -48,6 +326,35 @@ diff_state_add_chunk(struct diff_state *state, bool solved,
 	else
 		result = &state->temp_result;
 
+	/*
+	 * A solved chunk of the same type directly adjoining the
+	 * previous one extends it instead of adding a new entry, so
+	 * consumers see one chunk per region instead of fragments.
+	 */
+	if (solved) {
+		chunk = diff_chunk_list_append(result, &(struct diff_chunk) {
+			.solved = solved,
+			.left_start = left_start,
+			.left_count = left_count,
+			.right_start = right_start,
+			.right_count = right_count,
+		});
+		if (chunk == NULL)
+			return NULL;
+		if (result == &state->result->chunks &&
+		    diff_stream_chunks(state, false) != DIFF_RC_OK)
+			return NULL;
+		debug("Add %s chunk:\n", chunk->solved ? "solved" :
+		    "UNSOLVED");
+		debug("L\n");
+		debug_dump_atoms(&state->left, chunk->left_start,
+		    chunk->left_count);
+		debug("R\n");
+		debug_dump_atoms(&state->right, chunk->right_start,
+		    chunk->right_count);
+		return chunk;
+	}
+
 	ARRAYLIST_ADD(chunk, *result);
 	if (chunk == NULL)
 		return NULL;
@@ -81,8 +388,17 @@ void
 diff_data_init_subsection(struct diff_data *d, struct diff_data *parent,
     struct diff_atom *from_atom, unsigned int atoms_count)
 {
-	struct diff_atom *last_atom = from_atom + atoms_count - 1;
+	struct diff_atom *last_atom;
+
+	if (atoms_count == 0) {
+		/* An empty side, e.g. an empty file. */
+		*d = (struct diff_data) {
+			.root = parent->root,
+		};
+		return;
+	}
 
+	last_atom = from_atom + atoms_count - 1;
 	*d = (struct diff_data) {
 		.data = from_atom->at,
 		.dlen = (last_atom->at + last_atom->len) - from_atom->at,
@@ -117,6 +433,8 @@ diff_algo_none(const struct diff_algo_config *algo_config,
 	debug_dump(&state->right);
 	debug_dump_myers_graph(&state->left, &state->right, NULL);
 
+	state->result->stats.none_passes++;
+
 	/* Add a chunk of equal lines, if any */
 	while (equal_atoms < DD_ATOM_NB(&state->left) &&
 	    equal_atoms < DD_ATOM_NB(&state->right) &&
@@ -136,14 +454,14 @@ diff_algo_none(const struct diff_algo_config *algo_config,
 		if (!diff_state_add_chunk(state, true,
 		    DD_ATOM_AT(&state->left, equal_atoms),
 		    DD_ATOM_NB(&state->left) - equal_atoms,
-		    NULL, 0))
+		    DD_ATOM_AT(&state->right, equal_atoms), 0))
 			return DIFF_RC_ENOMEM;
 	}
 
 	/* Add a "plus" chunk with all lines from the right. */
 	if (equal_atoms < DD_ATOM_NB(&state->right)) {
 		if (!diff_state_add_chunk(state, true,
-		    NULL, 0,
+		    DD_ATOM_AT(&state->left, DD_ATOM_NB(&state->left)), 0,
 		    DD_ATOM_AT(&state->right, equal_atoms),
 		    DD_ATOM_NB(&state->right) - equal_atoms))
 			return DIFF_RC_ENOMEM;
@@ -151,6 +469,164 @@ diff_algo_none(const struct diff_algo_config *algo_config,
 	return DIFF_RC_OK;
 }
 
+/*
+ * The unsolved chunks a dividing algorithm leaves in temp_result are
+ * independent subproblems over disjoint atom ranges, so several
+ * threads can solve them concurrently.  Each worker pulls the next
+ * unsolved chunk off a shared counter and solves it into a private
+ * chunk list; the lists are stitched back into the final result in
+ * their original order afterwards.
+ */
+struct diff_solver_work {
+	struct diff_state *state;
+	const struct diff_algo_config *inner_algo;
+
+	/* One private chunk list per temp_result entry. */
+	struct diff_chunk_arraylist *solved;
+
+	pthread_mutex_t mutex;		/* protects next and rc */
+	unsigned int next;
+	enum diff_rc rc;
+};
+
+static void *
+diff_solve_chunks_worker(void *arg)
+{
+	struct diff_solver_work *work = arg;
+	struct diff_state *state = work->state;
+
+	for (;;) {
+		struct diff_result inner_result = {};
+		struct diff_state inner_state;
+		struct diff_chunk *c;
+		unsigned int i;
+		enum diff_rc rc;
+
+		pthread_mutex_lock(&work->mutex);
+		i = work->next++;
+		rc = work->rc;
+		pthread_mutex_unlock(&work->mutex);
+		if (rc != DIFF_RC_OK || i >= state->temp_result.len)
+			break;
+
+		c = &state->temp_result.head[i];
+		if (c->solved)
+			continue;
+
+		/*
+		 * The private diff_result only collects this chunk's
+		 * solved chunks; its left/right stay unused.
+		 */
+		inner_state = (struct diff_state) {
+			.result = &inner_result,
+			.recursion_depth_left = state->recursion_depth_left - 1,
+		};
+		diff_data_init_subsection(&inner_state.left, &state->left,
+		    c->left_start, c->left_count);
+		diff_data_init_subsection(&inner_state.right, &state->right,
+		    c->right_start, c->right_count);
+
+		rc = diff_run_algo(work->inner_algo, &inner_state);
+		diff_arena_free(&inner_result.arena);
+		pthread_mutex_lock(&work->mutex);
+		state->result->stats.myers_passes +=
+		    inner_result.stats.myers_passes;
+		state->result->stats.myers_divide_passes +=
+		    inner_result.stats.myers_divide_passes;
+		state->result->stats.patience_passes +=
+		    inner_result.stats.patience_passes;
+		state->result->stats.histogram_passes +=
+		    inner_result.stats.histogram_passes;
+		state->result->stats.none_passes +=
+		    inner_result.stats.none_passes;
+		state->result->stats.fallbacks += inner_result.stats.fallbacks;
+		pthread_mutex_unlock(&work->mutex);
+		if (rc != DIFF_RC_OK) {
+			ARRAYLIST_FREE(inner_result.chunks);
+			pthread_mutex_lock(&work->mutex);
+			if (work->rc == DIFF_RC_OK)
+				work->rc = rc;
+			pthread_mutex_unlock(&work->mutex);
+			break;
+		}
+		work->solved[i] = inner_result.chunks;
+	}
+	return NULL;
+}
+
+static enum diff_rc
+diff_solve_chunks_parallel(const struct diff_algo_config *inner_algo,
+    struct diff_state *state, unsigned int nthreads)
+{
+	struct diff_solver_work work;
+	pthread_t *threads;
+	unsigned int i, j, started;
+	enum diff_rc rc;
+
+	work = (struct diff_solver_work) {
+		.state = state,
+		.inner_algo = inner_algo,
+		.rc = DIFF_RC_OK,
+	};
+	work.solved = recallocarray(NULL, 0, state->temp_result.len,
+	    sizeof(*work.solved));
+	if (work.solved == NULL)
+		return DIFF_RC_ENOMEM;
+	pthread_mutex_init(&work.mutex, NULL);
+
+	/* The calling thread works too, so spawn one thread less. */
+	threads = recallocarray(NULL, 0, nthreads - 1, sizeof(pthread_t));
+	started = 0;
+	if (threads != NULL) {
+		for (i = 0; i < nthreads - 1; i++) {
+			if (pthread_create(&threads[i], NULL,
+			    diff_solve_chunks_worker, &work) != 0)
+				break;
+			started++;
+		}
+	}
+	diff_solve_chunks_worker(&work);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_mutex_destroy(&work.mutex);
+
+	/* Stitch the private chunk lists back together in order. */
+	rc = work.rc;
+	for (i = 0; i < state->temp_result.len; i++) {
+		struct diff_chunk *c = &state->temp_result.head[i];
+		struct diff_chunk *final_c;
+
+		if (rc != DIFF_RC_OK) {
+			ARRAYLIST_FREE(work.solved[i]);
+			continue;
+		}
+		if (c->solved) {
+			final_c = diff_chunk_list_append(
+			    &state->result->chunks, c);
+			if (final_c == NULL) {
+				rc = DIFF_RC_ENOMEM;
+				continue;
+			}
+			rc = diff_stream_chunks(state, false);
+			continue;
+		}
+		for (j = 0; j < work.solved[i].len; j++) {
+			final_c = diff_chunk_list_append(
+			    &state->result->chunks, &work.solved[i].head[j]);
+			if (final_c == NULL) {
+				rc = DIFF_RC_ENOMEM;
+				break;
+			}
+		}
+		if (rc == DIFF_RC_OK)
+			rc = diff_stream_chunks(state, false);
+		ARRAYLIST_FREE(work.solved[i]);
+	}
+	free(work.solved);
+	return rc;
+}
+
 enum diff_rc
 diff_run_algo(const struct diff_algo_config *algo_config,
     struct diff_state *state)
@@ -171,6 +647,7 @@ diff_run_algo(const struct diff_algo_config *algo_config,
 	case DIFF_RC_USE_DIFF_ALGO_FALLBACK:
 		debug("Got DIFF_RC_USE_DIFF_ALGO_FALLBACK (%p)\n",
 		    algo_config->fallback_algo);
+		state->result->stats.fallbacks++;
 		rc = diff_run_algo(algo_config->fallback_algo, state);
 		goto return_rc;
 
@@ -191,19 +668,41 @@ diff_run_algo(const struct diff_algo_config *algo_config,
 	 * to result afterwards.
 	 */
 	int i;
+
+	/*
+	 * With more than one unsolved chunk and solver threads
+	 * configured, solve them concurrently instead.  Only the
+	 * outermost pass has solver_threads set, recursive passes
+	 * below always solve sequentially.
+	 */
+	if (state->solver_threads > 1) {
+		unsigned int unsolved_count = 0;
+
+		for (i = 0; i < state->temp_result.len; i++) {
+			if (!state->temp_result.head[i].solved)
+				unsolved_count++;
+		}
+		if (unsolved_count > 1) {
+			rc = diff_solve_chunks_parallel(
+			    algo_config->inner_algo, state,
+			    MIN(state->solver_threads, unsolved_count));
+			goto return_rc;
+		}
+	}
+
 	for (i = 0; i < state->temp_result.len; i++) {
 		struct diff_state inner_state;
 		struct diff_chunk *c = &state->temp_result.head[i];
 
 		if (c->solved) {
-			struct diff_chunk *final_c;
-
-			ARRAYLIST_ADD(final_c, state->result->chunks);
-			if (final_c == NULL) {
+			if (diff_chunk_list_append(&state->result->chunks,
+			    c) == NULL) {
 				rc = DIFF_RC_ENOMEM;
 				goto return_rc;
 			}
-			*final_c = *c;
+			rc = diff_stream_chunks(state, false);
+			if (rc != DIFF_RC_OK)
+				goto return_rc;
 			continue;
 		}
 
@@ -228,13 +727,149 @@ return_rc:
 	return rc;
 }
 
+enum diff_rc
+diff_atomize(const struct diff_config *config, struct diff_data *left,
+    struct diff_data *right)
+{
+	if (config->atomize_func == NULL)
+		return DIFF_RC_EINVAL;
+	left->flags = config->flags;
+	right->flags = config->flags;
+	return config->atomize_func(config->atomize_func_data, left, right);
+}
+
+/*
+ * Solve an atomized result: trim the common head and tail, intern the
+ * remaining middle and run the configured algorithm on it.  Shared by
+ * diff_main() and diff_main_prepared().
+ */
+static void
+diff_solve(const struct diff_config *config, struct diff_result *result)
+{
+	struct diff_state state;
+	uint64_t t_start = diff_now_ns();
+
+	state = (struct diff_state) {
+		.result = result,
+		.recursion_depth_left = config->max_recursion_depth ? : 1024,
+		.solver_threads = config->solver_threads,
+		.chunk_cb = config->chunk_cb,
+		.chunk_cb_data = config->chunk_cb_data,
+	};
+	diff_data_init_subsection(&state.left, &result->left,
+	    DD_ATOM_FIRST(&result->left), DD_ATOM_NB(&result->left));
+	diff_data_init_subsection(&state.right, &result->right,
+	    DD_ATOM_FIRST(&result->right), DD_ATOM_NB(&result->right));
+
+	/*
+	 * Most diffs only touch a small part of large files.  Trim the
+	 * common head and tail before running any algorithm, so that
+	 * e.g. Myers does not pay for tens of thousands of identical
+	 * leading and trailing lines in its d loop.  The checksums make
+	 * mismatching atoms cheap to reject.
+	 */
+	unsigned int nl = DD_ATOM_NB(&result->left);
+	unsigned int nr = DD_ATOM_NB(&result->right);
+	unsigned int prefix = 0, suffix = 0;
+	/* The flags that produced the hashes, not necessarily
+	 * config->flags if the roots were atomized separately. */
+	unsigned int flags = result->left.flags;
+
+	while (prefix < nl && prefix < nr &&
+	    diff_atom_same_flags(DD_ATOM_AT(&result->left, prefix),
+	    DD_ATOM_AT(&result->right, prefix), flags))
+		prefix++;
+	while (suffix < nl - prefix && suffix < nr - prefix &&
+	    diff_atom_same_flags(
+	    DD_ATOM_AT(&result->left, nl - 1 - suffix),
+	    DD_ATOM_AT(&result->right, nr - 1 - suffix), flags))
+		suffix++;
+
+	if (prefix) {
+		if (!diff_state_add_chunk(&state, true,
+		    DD_ATOM_AT(&result->left, 0), prefix,
+		    DD_ATOM_AT(&result->right, 0), prefix)) {
+			result->rc = DIFF_RC_ENOMEM;
+			return;
+		}
+	}
+
+	if (nl - prefix - suffix && nr - prefix - suffix) {
+		/*
+		 * Intern just the atoms the algorithms will look at,
+		 * i.e. the trimmed middle: identical content maps to an
+		 * identical integer id, turning every diff_atom_same()
+		 * below into an integer compare.
+		 */
+		result->rc = diff_atoms_intern(result,
+		    DD_ATOM_AT(&result->left, prefix),
+		    nl - prefix - suffix,
+		    DD_ATOM_AT(&result->right, prefix),
+		    nr - prefix - suffix);
+		if (result->rc != DIFF_RC_OK)
+			return;
+
+		/* Solve the trimmed middle with the configured algo. */
+		diff_data_init_subsection(&state.left, &result->left,
+		    DD_ATOM_AT(&result->left, prefix),
+		    nl - prefix - suffix);
+		diff_data_init_subsection(&state.right, &result->right,
+		    DD_ATOM_AT(&result->right, prefix),
+		    nr - prefix - suffix);
+
+		result->rc = diff_run_algo(config->algo, &state);
+		if (result->rc != DIFF_RC_OK)
+			return;
+	} else if (nl - prefix - suffix) {
+		/* Only left atoms remain: a "minus" chunk. */
+		if (!diff_state_add_chunk(&state, true,
+		    DD_ATOM_AT(&result->left, prefix),
+		    nl - prefix - suffix,
+		    DD_ATOM_AT(&result->right, prefix), 0)) {
+			result->rc = DIFF_RC_ENOMEM;
+			return;
+		}
+	} else if (nr - prefix - suffix) {
+		/* Only right atoms remain: a "plus" chunk. */
+		if (!diff_state_add_chunk(&state, true,
+		    DD_ATOM_AT(&result->left, prefix), 0,
+		    DD_ATOM_AT(&result->right, prefix),
+		    nr - prefix - suffix)) {
+			result->rc = DIFF_RC_ENOMEM;
+			return;
+		}
+	}
+
+	if (suffix) {
+		if (!diff_state_add_chunk(&state, true,
+		    DD_ATOM_AT(&result->left, nl - suffix), suffix,
+		    DD_ATOM_AT(&result->right, nr - suffix), suffix)) {
+			result->rc = DIFF_RC_ENOMEM;
+			return;
+		}
+	}
+
+	result->rc = diff_stream_chunks(&state, true);
+	result->stats.solve_ns = diff_now_ns() - t_start;
+}
+
+/*
+ * Error paths below diff_solve() can only report failure as ENOMEM;
+ * restore a streaming callback's own abort code if there was one.
+ */
+static void
+diff_solve_finish(struct diff_result *result)
+{
+	if (result->stream_abort_rc != DIFF_RC_OK)
+		result->rc = result->stream_abort_rc;
+}
+
 struct diff_result *
 diff_main(const struct diff_config *config,
     const uint8_t *left_data, size_t left_len,
     const uint8_t *right_data, size_t right_len)
 {
 	struct diff_result *result;
-	struct diff_state state;
 
 	result = calloc(1, sizeof(struct diff_result));
 	if (result == NULL)
@@ -243,30 +878,146 @@ diff_main(const struct diff_config *config,
 	diff_data_init_root(&result->left, left_data, left_len);
 	diff_data_init_root(&result->right, right_data, right_len);
 
-	if (config->atomize_func == NULL) {
-		result->rc = DIFF_RC_EINVAL;
+	/*
+	 * Byte-identical inputs need no atomization and no algorithm;
+	 * one streaming memcmp decides.  The result then has an empty
+	 * chunk list, like any diff without differences renders empty
+	 * output.
+	 */
+	if (left_len == right_len &&
+	    (left_len == 0 || memcmp(left_data, right_data, left_len) == 0)) {
+		result->rc = DIFF_RC_OK;
 		return result;
 	}
 
-	result->rc = config->atomize_func(config->atomize_func_data,
-	    &result->left, &result->right);
+	uint64_t t_start = diff_now_ns();
+	result->rc = diff_atomize(config, &result->left, &result->right);
+	result->stats.atomize_ns = diff_now_ns() - t_start;
 	if (result->rc != DIFF_RC_OK)
 		return result;
 
-	state = (struct diff_state) {
-		.result = result,
-		.recursion_depth_left = config->max_recursion_depth ? : 1024,
-	};
-	diff_data_init_subsection(&state.left, &result->left,
-	    DD_ATOM_FIRST(&result->left), DD_ATOM_NB(&result->left));
-	diff_data_init_subsection(&state.right, &result->right,
-	    DD_ATOM_FIRST(&result->right), DD_ATOM_NB(&result->right));
+	diff_solve(config, result);
+	diff_solve_finish(result);
+	return result;
+}
+
+struct diff_result *
+diff_main_prepared(const struct diff_config *config,
+    struct diff_data *left_root, struct diff_data *right_root)
+{
+	struct diff_result *result;
+	struct diff_atom *atom;
+
+	result = calloc(1, sizeof(struct diff_result));
+	if (result == NULL)
+		return NULL;
+
+	/*
+	 * Reference the caller's atomization rather than owning it:
+	 * clearing atoms.allocated keeps diff_result_free() from
+	 * freeing the caller's atom arrays.
+	 */
+	result->left = *left_root;
+	result->left.atoms.allocated = 0;
+	result->left.root = &result->left;
+	result->left.algo_data = NULL;
+	result->right = *right_root;
+	result->right.atoms.allocated = 0;
+	result->right.root = &result->right;
+	result->right.algo_data = NULL;
 
-	result->rc = diff_run_algo(config->algo, &state);
+	/*
+	 * Atom ids are scoped to one run; a root reused from an earlier
+	 * run still carries that run's ids, which must not be compared
+	 * against a freshly atomized other side.
+	 */
+	DD_ATOM_FOREACH(atom, &result->left, 0)
+		atom->id = 0;
+	DD_ATOM_FOREACH(atom, &result->right, 0)
+		atom->id = 0;
 
+	diff_solve(config, result);
+	diff_solve_finish(result);
 	return result;
 }
 
+struct diff_result *
+diff_refine_chunk_pair(const struct diff_config *config,
+    const struct diff_chunk *minus, const struct diff_chunk *plus)
+{
+	struct diff_config token_config;
+	const struct diff_atom *last;
+	const uint8_t *ldata, *rdata;
+	size_t llen, rlen;
+
+	if (minus->left_count == 0 || plus->right_count == 0)
+		return NULL;
+
+	ldata = minus->left_start->at;
+	last = minus->left_start + minus->left_count - 1;
+	llen = (last->at + last->len) - ldata;
+
+	rdata = plus->right_start->at;
+	last = plus->right_start + plus->right_count - 1;
+	rlen = (last->at + last->len) - rdata;
+
+	token_config = *config;
+	token_config.atomize_func = diff_atomize_text_by_token;
+	token_config.atomize_func_data = NULL;
+	token_config.chunk_cb = NULL;
+
+	return diff_main(&token_config, ldata, llen, rdata, rlen);
+}
+
+enum diff_rc
+diff_main_one_to_many(const struct diff_config *config,
+    const uint8_t *left_data, size_t left_len,
+    const struct diff_many_right *rights, unsigned int nrights,
+    diff_result_cb_t cb, void *cb_arg)
+{
+	struct diff_data left_root = {};
+	enum diff_rc rc = DIFF_RC_OK;
+	unsigned int i;
+
+	diff_data_init_root(&left_root, left_data, left_len);
+
+	for (i = 0; i < nrights; i++) {
+		struct diff_data right_root = {};
+		struct diff_result *result;
+
+		diff_data_init_root(&right_root, rights[i].data,
+		    rights[i].len);
+
+		/*
+		 * The first pass atomizes both sides; after that the
+		 * left side is already atomized and only the right is
+		 * scanned.
+		 */
+		rc = diff_atomize(config, &left_root, &right_root);
+		if (rc != DIFF_RC_OK)
+			break;
+
+		result = diff_main_prepared(config, &left_root,
+		    &right_root);
+		if (result == NULL) {
+			diff_data_free(&right_root);
+			rc = DIFF_RC_ENOMEM;
+			break;
+		}
+		if (result->rc != DIFF_RC_OK)
+			rc = result->rc;
+		else
+			rc = cb(i, result, cb_arg);
+		diff_result_free(result);
+		diff_data_free(&right_root);
+		if (rc != DIFF_RC_OK)
+			break;
+	}
+
+	diff_data_free(&left_root);
+	return rc;
+}
+
 void
 diff_result_free(struct diff_result *result)
 {
@@ -275,5 +1026,6 @@ diff_result_free(struct diff_result *result)
 	diff_data_free(&result->left);
 	diff_data_free(&result->right);
 	ARRAYLIST_FREE(result->chunks);
+	diff_arena_free(&result->arena);
 	free(result);
 }
@@ -90,25 +90,44 @@ struct diff_atom {
 	 */
 	unsigned int hash;
 
-	/* State for the Patience Diff algorithm */
-	/* TODO: keep a separate array for the patience state */
-	struct {
-		bool unique_here;
-		bool unique_in_both;
-		struct diff_atom *pos_in_other;
-		struct diff_atom *prev_stack;
-		struct range identical_lines;
-	} patience;
+	/*
+	 * Identical content gets an identical nonzero id across the two
+	 * sides of one diff_result, assigned after atomization; see
+	 * diff_atoms_intern().  Zero means the atom was not interned.
+	 */
+	unsigned int id;
 };
 
+/* Compare the actual content, ignoring any interning. */
 static inline bool
-diff_atom_same(const struct diff_atom *left, const struct diff_atom *right)
+diff_atom_same_content(const struct diff_atom *left,
+    const struct diff_atom *right)
 {
 	return left->hash == right->hash
 		&& left->len == right->len
 		&& memcmp(left->at, right->at, left->len) == 0;
 }
 
+/*
+ * Compare two atoms' content under the given DIFF_FLAG_*: exact bytes,
+ * or blank-normalized under DIFF_FLAG_IGNORE_WHITESPACE.
+ */
+bool diff_atom_same_flags(const struct diff_atom *left,
+    const struct diff_atom *right, unsigned int flags);
+
+/*
+ * Only valid for two atoms belonging to the same diff_result: once both
+ * sides are interned, identical content implies identical id and the
+ * comparison is a single integer compare.
+ */
+static inline bool
+diff_atom_same(const struct diff_atom *left, const struct diff_atom *right)
+{
+	if (left->id || right->id)
+		return left->id == right->id;
+	return diff_atom_same_content(left, right);
+}
+
 /*
  * For each file, there is a "root" struct diff_data referencing the entire
  * file, which the atoms are parsed from.  In recursion of diff algorithm,
@@ -123,8 +142,23 @@ struct diff_data {
 	size_t		 dlen;		/* size of the buffer */
 	ARRAYLIST_HEAD(, diff_atom) atoms;
 	struct diff_data *root;
+
+	/* DIFF_FLAG_* of the run, copied from the config by
+	 * diff_atomize() so the atomizer and interning see them. */
+	unsigned int flags;
+
+	/*
+	 * Per-atom state private to the diff algorithm currently
+	 * running on this diff_data, if that algorithm needs any; see
+	 * e.g. struct atom_patience in diff_patience.c.  Keeping this
+	 * out of struct diff_atom keeps the atom array dense for the
+	 * algorithms that don't need it.
+	 */
+	void *algo_data;
 };
 
+void diff_data_init_root(struct diff_data *dd, const uint8_t *data,
+    size_t dlen);
 void diff_data_free(struct diff_data *diff_data);
 
 #define foreach_diff_atom(_atom, _first, _count) \
@@ -218,13 +252,81 @@ struct diff_chunk {
 ARRAYLIST_HEAD(diff_chunk_arraylist, diff_chunk);
 #define DIFF_RESULT_ALLOC_BLOCKSIZE 128
 
+/*
+ * Bump allocator backing the transient allocations of the diff
+ * pipeline (algorithm state arrays, traversal columns, ...).  Memory
+ * is carved out of large malloc'd blocks; individual allocations are
+ * never freed, instead a caller takes a mark up front and releases
+ * back to it when done, which makes the cleanup of an algorithm pass
+ * a single call and lets recursive passes reuse the same blocks
+ * instead of hitting malloc each time.
+ */
+struct diff_arena_block;
+
+struct diff_arena {
+	struct diff_arena_block *block;	/* newest block, linked via prev */
+};
+
+struct diff_arena_mark {
+	struct diff_arena_block *block;
+	size_t used;
+};
+
+/* Allocate zeroed memory for nmemb members of size each. */
+void *diff_arena_alloc(struct diff_arena *arena, size_t nmemb, size_t size);
+void diff_arena_mark(struct diff_arena *arena, struct diff_arena_mark *mark);
+void diff_arena_release(struct diff_arena *arena,
+    const struct diff_arena_mark *mark);
+void diff_arena_free(struct diff_arena *arena);
+
+/*
+ * Runtime performance counters, collected unconditionally on every run
+ * since they cost next to nothing next to the work they count.  The
+ * wall times split the pipeline into its two stages; the pass counters
+ * show which algorithms actually ran and how often the configured
+ * chain fell through to a fallback.
+ */
+struct diff_stats {
+	uint64_t atomize_ns;		/* spent atomizing the input */
+	uint64_t solve_ns;		/* spent in the algorithms */
+	unsigned int myers_passes;
+	unsigned int myers_divide_passes;
+	unsigned int patience_passes;
+	unsigned int histogram_passes;
+	unsigned int none_passes;
+	unsigned int fallbacks;
+};
+
 struct diff_result {
 	enum diff_rc rc;
 	struct diff_data left;
 	struct diff_data right;
 	struct diff_chunk_arraylist chunks;
+
+	/* How many leading chunks were already streamed out through
+	 * the config's chunk_cb, see diff_chunk_cb_t. */
+	unsigned int chunks_streamed;
+
+	/* A non-OK return of the chunk_cb, so the abort code survives
+	 * error paths that can only signal failure as such. */
+	enum diff_rc stream_abort_rc;
+
+	/* Scratch memory for the algorithms; freed with the result. */
+	struct diff_arena arena;
+
+	struct diff_stats stats;
 };
 
+/*
+ * Callback receiving every chunk as soon as it has reached its final
+ * place and can no longer change, while the solve is still running --
+ * this lets output production overlap with solving.  Chunks arrive in
+ * their final order.  Returning anything but DIFF_RC_OK aborts the
+ * solve with that code.
+ */
+typedef enum diff_rc (*diff_chunk_cb_t)(const struct diff_chunk *chunk,
+    void *cb_data);
+
 struct diff_state {
 	/* The final result passed to the original diff caller. */
 	struct diff_result *result;
@@ -238,6 +340,20 @@ struct diff_state {
 
 	unsigned int recursion_depth_left;
 
+	/*
+	 * Number of threads that may solve leftover unsolved chunks
+	 * concurrently; zero in all recursive diff_state instances, so
+	 * only the outermost algorithm pass parallelizes.
+	 */
+	unsigned int solver_threads;
+
+	/*
+	 * Copied from the config; set only in the outermost state,
+	 * where chunks reach their final order.
+	 */
+	diff_chunk_cb_t chunk_cb;
+	void *chunk_cb_data;
+
 	/*
 	 * Remaining chunks from one diff algorithm pass, if any
 	 * solved == false chunks came up.
@@ -267,6 +383,18 @@ typedef enum diff_rc (*diff_atomize_func_t)(void *func_data, struct diff_data *l
 
 extern enum diff_rc diff_atomize_text_by_line(void *func_data, struct diff_data *left, struct diff_data *right);
 
+/*
+ * Same, but atomizing the two (independent) sides concurrently in two
+ * threads when the input sizes warrant it.
+ */
+extern enum diff_rc diff_atomize_text_by_line_parallel(void *func_data, struct diff_data *left, struct diff_data *right);
+
+/*
+ * Atomize by word-level tokens instead of lines: runs of alphanumerics
+ * or of blanks, and single bytes of anything else.
+ */
+extern enum diff_rc diff_atomize_text_by_token(void *func_data, struct diff_data *left, struct diff_data *right);
+
 struct diff_algo_config;
 typedef enum diff_rc (*diff_algo_impl_t)(const struct diff_algo_config *algo_config, struct diff_state *state);
 
@@ -298,6 +426,14 @@ extern enum diff_rc diff_algo_myers_divide(const struct diff_algo_config *algo_c
  */
 extern enum diff_rc diff_algo_patience(const struct diff_algo_config *algo_config, struct diff_state *state);
 
+/*
+ * Histogram Diff algorithm: divide at the rarest atom common to both
+ * sides, around the longest identical run containing it.  Requires
+ * interned atoms; needs a fallback algo when the two sides have no
+ * sufficiently rare atom in common.
+ */
+extern enum diff_rc diff_algo_histogram(const struct diff_algo_config *algo_config, struct diff_state *state);
+
 /* Diff algorithms to use, possibly nested. For example:
  *
  * struct diff_algo_config myers, patience, myers_divide;
@@ -351,10 +487,23 @@ struct diff_algo_config {
 	const struct diff_algo_config *fallback_algo;
 };
 
+/*
+ * Treat runs of spaces and tabs as equal to each other and ignore
+ * trailing blanks, like diff(1) -b: implemented by the atomizer
+ * checksumming the normalized line and by interning comparing the
+ * normalized content.
+ */
+#define DIFF_FLAG_IGNORE_WHITESPACE	0x00000001
+
 struct diff_config {
 	diff_atomize_func_t atomize_func;
 	void *atomize_func_data;
 
+	unsigned int flags;		/* DIFF_FLAG_* */
+
+	diff_chunk_cb_t chunk_cb;
+	void *chunk_cb_data;
+
 	const struct diff_algo_config *algo;
 
 	/*
@@ -365,9 +514,68 @@ struct diff_config {
 	 * (i.e. remove all left atoms and add all right atoms).
 	 */
 	unsigned int max_recursion_depth;
+
+	/*
+	 * Solve the unsolved chunks left over by a dividing algorithm
+	 * with up to this many threads; the chunks are independent
+	 * subproblems over disjoint atom ranges.  Zero or one means
+	 * solving sequentially.
+	 */
+	unsigned int solver_threads;
 };
 
 struct diff_result *diff_main(const struct diff_config *config,
 			      const uint8_t *left_data, size_t left_len,
 			      const uint8_t *right_data, size_t right_len);
 void diff_result_free(struct diff_result *result);
+
+/*
+ * Atomize both sides with the configured atomizer.  A side that
+ * already has atoms is left untouched, so a caller repeatedly diffing
+ * against the same file (e.g. re-diffing an edited buffer) can keep
+ * one side's atomization across runs and only pay for the side that
+ * changed.
+ */
+enum diff_rc diff_atomize(const struct diff_config *config,
+    struct diff_data *left, struct diff_data *right);
+
+/*
+ * Like diff_main(), but takes two roots prepared with
+ * diff_data_init_root() and diff_atomize().  The result references the
+ * caller's atom arrays instead of owning them; the caller remains
+ * responsible for freeing the roots with diff_data_free() after the
+ * result is no longer in use.
+ */
+struct diff_result *diff_main_prepared(const struct diff_config *config,
+    struct diff_data *left_root, struct diff_data *right_root);
+
+/*
+ * Diff one left input against many rights in turn, atomizing the left
+ * side only once.  Each result is handed to the callback and torn
+ * down when the callback returns; a callback returning anything but
+ * DIFF_RC_OK aborts the remaining rights.  Returns the first non-OK
+ * code encountered, from a callback or from diffing itself.
+ */
+struct diff_many_right {
+	const uint8_t *data;
+	size_t len;
+};
+
+typedef enum diff_rc (*diff_result_cb_t)(unsigned int idx,
+    struct diff_result *result, void *cb_arg);
+
+/*
+ * Re-diff one changed region of a line-level result at token
+ * granularity: the byte ranges covered by a minus chunk and a plus
+ * chunk are diffed with diff_atomize_text_by_token() and the given
+ * config's algorithm.  Meant to be called lazily, per hunk that is
+ * actually rendered.  Returns a fresh result to be freed with
+ * diff_result_free(), or NULL on allocation failure.
+ */
+struct diff_result *diff_refine_chunk_pair(const struct diff_config *config,
+    const struct diff_chunk *minus, const struct diff_chunk *plus);
+
+enum diff_rc diff_main_one_to_many(const struct diff_config *config,
+    const uint8_t *left_data, size_t left_len,
+    const struct diff_many_right *rights, unsigned int nrights,
+    diff_result_cb_t cb, void *cb_arg);
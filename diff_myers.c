@@ -22,8 +22,10 @@
  * and the canonical Myers algorithm (using quadratic space).
  */
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "diff_main.h"
 #include "debug.h"
@@ -646,6 +648,14 @@ diff_divide_myers_backward(struct diff_data *left, struct diff_data *right,
 		    xc_to_y(x, c, delta) > DD_ATOM_NB(right))
 			continue;
 
+		/*
+		 * When running concurrently with the forward sweep, the
+		 * meeting check is done separately after both sweeps
+		 * joined; see diff_divide_myers_backward_check().
+		 */
+		if (meeting_snake == NULL)
+			continue;
+
 		/*
 		 * Figured out a new backwards traversal, see if this has gone
 		 * onto or even past a preceding forwards traversal.
@@ -730,6 +740,112 @@ diff_divide_myers_backward(struct diff_data *left, struct diff_data *right,
 	}
 }
 
+/*
+ * The meeting check of the backward sweep, as a separate scan over the
+ * finished column.  Used when forward and backward sweeps of the same d
+ * run concurrently: with an even delta the backward check reads
+ * kd_forward[] entries the forward sweep is writing at that very d, so
+ * it has to wait until both sweeps are done.  The previous positions it
+ * needs are recomputed from the d-1 entries, which both sweeps leave
+ * untouched.
+ */
+static void
+diff_divide_myers_backward_check(struct diff_data *left,
+    struct diff_data *right, int *kd_forward, int *kd_backward, int d,
+    struct diff_box *meeting_snake)
+{
+	int delta = (int)DD_ATOM_NB(right) - (int)DD_ATOM_NB(left);
+	int c;
+
+	/* Meetings on the backward sweep only exist for even deltas. */
+	if ((delta & 1) != 0)
+		return;
+
+	for (c = d; c >= -d; c -= 2) {
+		int prev_x, prev_y, x, k, forward_x, forward_y;
+
+		if (c < -(int)DD_ATOM_NB(left) || c > (int)DD_ATOM_NB(right)) {
+			if (c < 0)
+				break;
+			continue;
+		}
+
+		x = kd_backward[c];
+		if (d == 0) {
+			/* The logical previous position is the bottom
+			 * right corner the sweep started from. */
+			prev_x = (int)DD_ATOM_NB(left);
+			prev_y = xc_to_y(prev_x, 0, delta);
+		} else if (c > -d && (c == d ||
+		    (c - 1 >= -(int)DD_ATOM_NB(right) &&
+		     kd_backward[c - 1] <= kd_backward[c + 1]))) {
+			prev_x = kd_backward[c - 1];
+			prev_y = xc_to_y(prev_x, c - 1, delta);
+		} else {
+			prev_x = kd_backward[c + 1];
+			prev_y = xc_to_y(prev_x, c + 1, delta);
+		}
+
+		k = c_to_k(c, delta);
+		if (k < -d || k > d)
+			continue;
+
+		forward_x = kd_forward[k];
+		forward_y = xk_to_y(forward_x, k);
+		if (forward_x <= prev_x && forward_y <= prev_y &&
+		    forward_x >= x) {
+			*meeting_snake = (struct diff_box){
+				.left_start = x,
+				.left_end = forward_x,
+				.right_start = xc_to_y(x, c, delta),
+				.right_end = xk_to_y(forward_x, k),
+			};
+			debug("HIT x=%u,%u - y=%u,%u\n",
+			    meeting_snake->left_start,
+			    meeting_snake->right_start,
+			    meeting_snake->left_end,
+			    meeting_snake->right_end);
+			return;
+		}
+	}
+}
+
+/*
+ * Helper thread running the backward sweeps while the calling thread
+ * does the forward sweeps.  The two sweeps of one d step only touch
+ * disjoint diagonal parities of each other's columns, so they can run
+ * concurrently; the barriers keep them in lockstep per d.
+ */
+struct myers_divide_worker {
+	struct diff_data *left, *right;
+	int *kd_forward, *kd_backward;
+	int d;
+	bool stop;
+	pthread_barrier_t start_barrier, done_barrier;
+};
+
+static void *
+diff_divide_myers_backward_worker(void *arg)
+{
+	struct myers_divide_worker *w = arg;
+
+	for (;;) {
+		pthread_barrier_wait(&w->start_barrier);
+		if (w->stop)
+			break;
+		diff_divide_myers_backward(w->left, w->right, w->kd_forward,
+		    w->kd_backward, w->d, NULL);
+		pthread_barrier_wait(&w->done_barrier);
+	}
+	return NULL;
+}
+
+/*
+ * Problems below this many atoms solve faster than the per-step
+ * barrier synchronization costs.
+ */
+#define MYERS_DIVIDE_PARALLEL_MIN	4096
+
 /*
  * Myers "Divide et Impera": tracing forwards from the start and backwards
  * from the end to find a midpoint that divides the problem into smaller
@@ -742,6 +858,8 @@ diff_algo_myers_divide(const struct diff_algo_config *algo_config,
 	enum diff_rc rc = DIFF_RC_ENOMEM;
 	struct diff_data *left = &state->left;
 	struct diff_data *right = &state->right;
+	struct diff_arena *arena = &state->result->arena;
+	struct diff_arena_mark arena_mark;
 	unsigned int max;
 	size_t kd_len, kd_buf_size;
 	int d, i, *kd_buf, *kd_forward, *kd_backward;
@@ -754,6 +872,8 @@ diff_algo_myers_divide(const struct diff_algo_config *algo_config,
 	debug_dump(right);
 	debug_dump_myers_graph(left, right, NULL);
 
+	state->result->stats.myers_divide_passes++;
+
 	/*
 	 * Allocate two columns of a Myers graph, one for the forward and
 	 * one for the backward traversal.
@@ -761,7 +881,8 @@ diff_algo_myers_divide(const struct diff_algo_config *algo_config,
 	max = DD_ATOM_NB(left) + DD_ATOM_NB(right);
 	kd_len = max + 1;
 	kd_buf_size = kd_len << 1;
-	kd_buf = reallocarray(NULL, kd_buf_size, sizeof(int));
+	diff_arena_mark(arena, &arena_mark);
+	kd_buf = diff_arena_alloc(arena, kd_buf_size, sizeof(int));
 	if (kd_buf == NULL)
 		return DIFF_RC_ENOMEM;
 	for (i = 0; i < kd_buf_size; i++)
@@ -777,16 +898,69 @@ diff_algo_myers_divide(const struct diff_algo_config *algo_config,
 	kd_forward += max/2;
 	kd_backward += max/2;
 
+	/*
+	 * On problems large enough to pay for the synchronization, run
+	 * the backward sweep of each d step in a helper thread
+	 * alongside the forward sweep.  With an odd delta the forward
+	 * sweep's own meeting check only reads backward entries of the
+	 * previous step, which is safe; with an even delta the meeting
+	 * check runs separately once both sweeps are done.
+	 */
+	struct myers_divide_worker worker = {
+		.left = left,
+		.right = right,
+		.kd_forward = kd_forward,
+		.kd_backward = kd_backward,
+	};
+	pthread_t worker_thread;
+	bool threaded = false;
+
+	if (max >= MYERS_DIVIDE_PARALLEL_MIN &&
+	    sysconf(_SC_NPROCESSORS_ONLN) > 1 &&
+	    pthread_barrier_init(&worker.start_barrier, NULL, 2) == 0) {
+		if (pthread_barrier_init(&worker.done_barrier, NULL, 2) == 0) {
+			if (pthread_create(&worker_thread, NULL,
+			    diff_divide_myers_backward_worker, &worker) == 0)
+				threaded = true;
+			else
+				pthread_barrier_destroy(&worker.done_barrier);
+		}
+		if (!threaded)
+			pthread_barrier_destroy(&worker.start_barrier);
+	}
+
 	for (d = 0; d <= (max/2); d++) {
 		debug("-- d=%d\n", d);
-		diff_divide_myers_forward(left, right, kd_forward, kd_backward,
-		    d, &mid_snake);
-		if (!diff_box_empty(&mid_snake))
-			break;
-		diff_divide_myers_backward(left, right, kd_forward, kd_backward,
-		    d, &mid_snake);
-		if (!diff_box_empty(&mid_snake))
-			break;
+		if (threaded) {
+			worker.d = d;
+			pthread_barrier_wait(&worker.start_barrier);
+			diff_divide_myers_forward(left, right, kd_forward,
+			    kd_backward, d, &mid_snake);
+			pthread_barrier_wait(&worker.done_barrier);
+			if (!diff_box_empty(&mid_snake))
+				break;
+			diff_divide_myers_backward_check(left, right,
+			    kd_forward, kd_backward, d, &mid_snake);
+			if (!diff_box_empty(&mid_snake))
+				break;
+		} else {
+			diff_divide_myers_forward(left, right, kd_forward,
+			    kd_backward, d, &mid_snake);
+			if (!diff_box_empty(&mid_snake))
+				break;
+			diff_divide_myers_backward(left, right, kd_forward,
+			    kd_backward, d, &mid_snake);
+			if (!diff_box_empty(&mid_snake))
+				break;
+		}
+	}
+
+	if (threaded) {
+		worker.stop = true;
+		pthread_barrier_wait(&worker.start_barrier);
+		pthread_join(worker_thread, NULL);
+		pthread_barrier_destroy(&worker.start_barrier);
+		pthread_barrier_destroy(&worker.done_barrier);
 	}
 
 	if (diff_box_empty(&mid_snake)) {
@@ -904,11 +1078,221 @@ diff_algo_myers_divide(const struct diff_algo_config *algo_config,
 	rc = DIFF_RC_OK;
 
 return_rc:
-	free(kd_buf);
+	diff_arena_release(arena, &arena_mark);
 	debug("** END %s\n", __func__);
 	return rc;
 }
 
+/*
+ * Bit-parallel kernel for small subproblems: when one side has at most
+ * 64 atoms, one machine word holds a whole DP column of the LCS
+ * recurrence (Crochemore/Iliopoulos/Pinzon/Reid 2001, Hyyro 2004), so
+ * the other side is processed in O(n) word operations instead of an
+ * O((m+n)^2) graph traversal.  One word is kept per text position for
+ * the traceback; L(i,j) values are recovered from the stored columns
+ * with popcount.
+ *
+ * The "pattern" is whichever side fits in the word; ops are mapped
+ * back to minus/plus chunks according to which side that was.
+ */
+#define MYERS_SMALL_MAX		64
+
+enum myers_small_op {
+	MYERS_SMALL_EQ,		/* both sides advance, equal atoms */
+	MYERS_SMALL_PAT,	/* pattern side atom consumed alone */
+	MYERS_SMALL_TXT,	/* text side atom consumed alone */
+};
+
+static inline uint64_t
+myers_small_mask(unsigned int i)
+{
+	if (i == 0)
+		return 0;
+	if (i >= 64)
+		return ~(uint64_t)0;
+	return ((uint64_t)1 << i) - 1;
+}
+
+/* L(i,j): LCS length of pattern[0..i) and text[0..j). */
+static inline unsigned int
+myers_small_llcs(const uint64_t *v, unsigned int i, unsigned int j)
+{
+	return i - __builtin_popcountll(v[j] & myers_small_mask(i));
+}
+
+static enum diff_rc
+diff_algo_myers_small(struct diff_state *state)
+{
+	struct diff_data *left = &state->left;
+	struct diff_data *right = &state->right;
+	struct diff_data *pat, *txt;
+	struct diff_arena *arena = &state->result->arena;
+	struct diff_arena_mark mark;
+	struct diff_atom *atom;
+	uint64_t eq_mask[MYERS_SMALL_MAX];
+	unsigned int eq_id[MYERS_SMALL_MAX];
+	uint64_t *v;
+	uint8_t *ops;
+	unsigned int m, n, na = 0, nops = 0;
+	unsigned int i, j, k, li, ri;
+	bool left_is_pattern;
+	enum diff_rc rc = DIFF_RC_ENOMEM;
+
+	if (DD_ATOM_NB(left) <= MYERS_SMALL_MAX) {
+		pat = left;
+		txt = right;
+		left_is_pattern = true;
+	} else {
+		pat = right;
+		txt = left;
+		left_is_pattern = false;
+	}
+	m = DD_ATOM_NB(pat);
+	n = DD_ATOM_NB(txt);
+	if (m == 0 || n == 0)
+		return DIFF_RC_USE_DIFF_ALGO_FALLBACK;
+
+	/*
+	 * Match masks are keyed by the interned atom ids; without
+	 * interning there is nothing cheap to mask by.
+	 */
+	for (i = 0; i < m; i++) {
+		unsigned int id = DD_ATOM_AT(pat, i)->id;
+
+		if (id == 0)
+			return DIFF_RC_USE_DIFF_ALGO_FALLBACK;
+		for (k = 0; k < na; k++) {
+			if (eq_id[k] == id)
+				break;
+		}
+		if (k == na) {
+			eq_id[na] = id;
+			eq_mask[na] = 0;
+			na++;
+		}
+		eq_mask[k] |= (uint64_t)1 << i;
+	}
+	DD_ATOM_FOREACH(atom, txt, 0) {
+		if (atom->id == 0)
+			return DIFF_RC_USE_DIFF_ALGO_FALLBACK;
+	}
+
+	diff_arena_mark(arena, &mark);
+	v = diff_arena_alloc(arena, (size_t)n + 1, sizeof(uint64_t));
+	ops = diff_arena_alloc(arena, (size_t)m + n, sizeof(uint8_t));
+	if (v == NULL || ops == NULL)
+		goto return_rc;
+
+	v[0] = ~(uint64_t)0;
+	for (j = 1; j <= n; j++) {
+		unsigned int id = DD_ATOM_AT(txt, j - 1)->id;
+		uint64_t vv = v[j - 1], mm = 0, u;
+
+		for (k = 0; k < na; k++) {
+			if (eq_id[k] == id) {
+				mm = eq_mask[k];
+				break;
+			}
+		}
+		u = vv & mm;
+		v[j] = (vv + u) | (vv - u);
+	}
+
+	/*
+	 * Backtrace from (m, n).  Ties are broken so that, in forward
+	 * order, atoms removed from the left file come before atoms
+	 * added from the right file, matching the graph traversal's
+	 * preference.  Walking backwards that means consuming the
+	 * right file's side first.
+	 */
+	i = m;
+	j = n;
+	nops = 0;
+	while (i > 0 && j > 0) {
+		unsigned int l = myers_small_llcs(v, i, j);
+		bool txt_step = (l == myers_small_llcs(v, i, j - 1));
+		bool pat_step = (l == myers_small_llcs(v, i - 1, j));
+
+		if (left_is_pattern) {
+			/* text == right file: consume it first. */
+			if (txt_step) {
+				ops[nops++] = MYERS_SMALL_TXT;
+				j--;
+			} else if (pat_step) {
+				ops[nops++] = MYERS_SMALL_PAT;
+				i--;
+			} else {
+				ops[nops++] = MYERS_SMALL_EQ;
+				i--;
+				j--;
+			}
+		} else {
+			/* pattern == right file: consume it first. */
+			if (pat_step) {
+				ops[nops++] = MYERS_SMALL_PAT;
+				i--;
+			} else if (txt_step) {
+				ops[nops++] = MYERS_SMALL_TXT;
+				j--;
+			} else {
+				ops[nops++] = MYERS_SMALL_EQ;
+				i--;
+				j--;
+			}
+		}
+	}
+	while (i > 0) {
+		ops[nops++] = MYERS_SMALL_PAT;
+		i--;
+	}
+	while (j > 0) {
+		ops[nops++] = MYERS_SMALL_TXT;
+		j--;
+	}
+
+	/* Emit the chunks in forward order, grouping runs of one op. */
+	li = 0;
+	ri = 0;
+	k = nops;
+	while (k > 0) {
+		uint8_t op = ops[k - 1];
+		unsigned int run = 0;
+
+		while (k > 0 && ops[k - 1] == op) {
+			run++;
+			k--;
+		}
+
+		if (op == MYERS_SMALL_EQ) {
+			if (!diff_state_add_chunk(state, true,
+			    DD_ATOM_AT(left, li), run,
+			    DD_ATOM_AT(right, ri), run))
+				goto return_rc;
+			li += run;
+			ri += run;
+		} else if ((op == MYERS_SMALL_PAT) == left_is_pattern) {
+			/* Atoms removed from the left. */
+			if (!diff_state_add_chunk(state, true,
+			    DD_ATOM_AT(left, li), run,
+			    DD_ATOM_AT(right, ri), 0))
+				goto return_rc;
+			li += run;
+		} else {
+			/* Atoms added from the right. */
+			if (!diff_state_add_chunk(state, true,
+			    DD_ATOM_AT(left, li), 0,
+			    DD_ATOM_AT(right, ri), run))
+				goto return_rc;
+			ri += run;
+		}
+	}
+
+	rc = DIFF_RC_OK;
+return_rc:
+	diff_arena_release(arena, &mark);
+	return rc;
+}
+
 /*
  * Myers Diff tracing from the start all the way through to the end, requiring
  * quadratic amounts of memory. This can fail if the required space surpasses
@@ -926,9 +1310,11 @@ diff_algo_myers(const struct diff_algo_config *algo_config,
 	enum diff_rc rc = DIFF_RC_ENOMEM;
 	struct diff_data *left = &state->left;
 	struct diff_data *right = &state->right;
+	struct diff_arena *arena = &state->result->arena;
+	struct diff_arena_mark arena_mark;
 	unsigned int max;
-	size_t kd_len, kd_buf_size;
-	int d, i, *kd_buf, *kd_origin, *kd_column;
+	size_t state_size, columns_cap;
+	int d, i, **kd_columns, *kd_column;
 	int backtrack_d, backtrack_k;
 	int k, x, y;
 
@@ -939,42 +1325,98 @@ diff_algo_myers(const struct diff_algo_config *algo_config,
 	debug_dump(right);
 	debug_dump_myers_graph(left, right, NULL);
 
+	state->result->stats.myers_passes++;
+
 	/*
-	 * Allocate two columns of a Myers graph, one for the forward and
-	 * one for the backward traversal.
+	 * When one side fits into a machine word, the bit-parallel
+	 * kernel solves the problem in linear time; it declines with
+	 * DIFF_RC_USE_DIFF_ALGO_FALLBACK when it does not apply, in
+	 * which case the graph traversal below runs as always.
 	 */
-	max = DD_ATOM_NB(left) + DD_ATOM_NB(right);
-	kd_len = max + 1 + max;
-	kd_buf_size = kd_len * kd_len;
-	debug("state size: %zu\n", kd_buf_size);
-	if (kd_buf_size < kd_len /* overflow? */ ||
-	    kd_buf_size * sizeof(int) > algo_config->permitted_state_size) {
-		debug("state size %zu > permitted_state_size %zu,"
-		    " use fallback_algo\n", kd_buf_size,
-		    algo_config->permitted_state_size);
-		return DIFF_RC_USE_DIFF_ALGO_FALLBACK;
+	if (DD_ATOM_NB(left) <= MYERS_SMALL_MAX ||
+	    DD_ATOM_NB(right) <= MYERS_SMALL_MAX) {
+		rc = diff_algo_myers_small(state);
+		if (rc != DIFF_RC_USE_DIFF_ALGO_FALLBACK)
+			return rc;
+		rc = DIFF_RC_ENOMEM;
 	}
 
-	kd_buf = reallocarray(NULL, kd_buf_size, sizeof(int));
-	if (kd_buf == NULL)
-		return DIFF_RC_ENOMEM;
-	for (i = 0; i < kd_buf_size; i++)
-		kd_buf[i] = -1;
-
 	/*
-	 * The 'k' axis in Myers spans positive and negative indexes,
-	 * so point the kd to the middle.
-	 * It is then possible to index from -max .. max.
+	 * One column of the Myers graph is kept per d step.  The columns
+	 * are allocated incrementally as d grows, each sized to the 2d+1
+	 * diagonals the step can touch (plus one extra int so that the
+	 * backtrace below may repurpose index 1 even at d == 0), so a
+	 * diff that finishes at small d only ever pays for the state it
+	 * actually used.  The permitted_state_size limit is checked
+	 * against this actual usage, letting the algorithm start on
+	 * large files and only fall back if the diff turns out big.
 	 */
-	kd_origin = kd_buf + max;
-	kd_column = kd_origin;
+	max = DD_ATOM_NB(left) + DD_ATOM_NB(right);
+	state_size = 0;
+
+	diff_arena_mark(arena, &arena_mark);
+	columns_cap = 64;
+	kd_columns = diff_arena_alloc(arena, columns_cap, sizeof(int *));
+	if (kd_columns == NULL)
+		return DIFF_RC_ENOMEM;
 
 	backtrack_d = -1;
 	backtrack_k = 0;
-	for (d = 0; d <= max; d++, kd_column += kd_len) {
+	for (d = 0; d <= max; d++) {
+		/*
+		 * 2d+1 diagonals, plus a two-slot margin on both sides:
+		 * the backtrace below reads k-1 and k+1 of the previous
+		 * column unguarded (up to two diagonals past that
+		 * column's own range) and relies on the -1 fill there,
+		 * and it repurposes index 1 even at d == 0.
+		 */
+		size_t column_size = 2 * (size_t)d + 5;
+
 		debug("-- d=%d\n", d);
 		debug("-- %s d=%d\n", __func__, d);
 
+		if (d >= columns_cap) {
+			int **new_columns;
+
+			new_columns = diff_arena_alloc(arena, columns_cap * 2,
+			    sizeof(int *));
+			if (new_columns == NULL) {
+				rc = DIFF_RC_ENOMEM;
+				goto return_rc;
+			}
+			memcpy(new_columns, kd_columns,
+			    columns_cap * sizeof(int *));
+			kd_columns = new_columns;
+			columns_cap *= 2;
+		}
+
+		state_size += column_size;
+		if (algo_config->permitted_state_size &&
+		    state_size * sizeof(int) >
+		    algo_config->permitted_state_size) {
+			debug("state size %zu > permitted_state_size %zu,"
+			    " use fallback_algo\n",
+			    state_size * sizeof(int),
+			    algo_config->permitted_state_size);
+			rc = DIFF_RC_USE_DIFF_ALGO_FALLBACK;
+			goto return_rc;
+		}
+
+		kd_column = diff_arena_alloc(arena, column_size, sizeof(int));
+		if (kd_column == NULL) {
+			rc = DIFF_RC_ENOMEM;
+			goto return_rc;
+		}
+		for (i = 0; i < column_size; i++)
+			kd_column[i] = -1;
+		/*
+		 * The 'k' axis spans negative and positive indexes, so
+		 * point at the middle of the column, allowing index
+		 * -d-2 .. d+2.
+		 */
+		kd_column += d + 2;
+		kd_columns[d] = kd_column;
+
 		for (k = d; k >= -d; k -= 2) {
 			if (k < -(int)DD_ATOM_NB(right) ||
 			    k > (int)DD_ATOM_NB(left)) {
@@ -1010,7 +1452,7 @@ diff_algo_myers(const struct diff_algo_config *algo_config,
 				 */
 				x = 0;
 			} else {
-				int *kd_prev_column = kd_column - kd_len;
+				int *kd_prev_column = kd_columns[d - 1];
 
 				/*
 				 * Favoring "-" lines first means favoring
@@ -1112,7 +1554,6 @@ diff_algo_myers(const struct diff_algo_config *algo_config,
 			break;
 	}
 
-	debug_dump_myers_graph(left, right, kd_origin);
 
 	/* backtrack. A matrix spanning from start to end of the file is ready:
 	 *
@@ -1137,6 +1578,7 @@ diff_algo_myers(const struct diff_algo_config *algo_config,
 	 *
 	 */
 	for (d = backtrack_d, k = backtrack_k; d >= 0; d--) {
+		kd_column = kd_columns[d];
 		x = kd_column[k];
 		y = xk_to_y(x, k);
 
@@ -1151,10 +1593,10 @@ diff_algo_myers(const struct diff_algo_config *algo_config,
 		debug("Backtrack d=%d: xy=(%d, %d)\n",
 		    d, kd_column[0], kd_column[1]);
 
-		/* Don't access memory before kd_buf */
+		/* Don't access memory before the first column */
 		if (d == 0)
 			break;
-		int *kd_prev_column = kd_column - kd_len;
+		int *kd_prev_column = kd_columns[d - 1];
 
 		/* When y == 0, backtracking downwards (k-1) is the only way.
 		 * When x == 0, backtracking upwards (k+1) is the only way.
@@ -1190,7 +1632,6 @@ diff_algo_myers(const struct diff_algo_config *algo_config,
 			debug("prev k=k+1=%d x=%d y=%d\n", k,
 			    kd_prev_column[k], xk_to_y(kd_prev_column[k], k));
 		}
-		kd_column = kd_prev_column;
 	}
 
 	/*
@@ -1201,10 +1642,9 @@ diff_algo_myers(const struct diff_algo_config *algo_config,
 	x = 0;
 	y = 0;
 
-	kd_column = kd_origin;
-	for (d = 0; d <= backtrack_d; d++, kd_column += kd_len) {
-		int next_x = kd_column[0];
-		int next_y = kd_column[1];
+	for (d = 0; d <= backtrack_d; d++) {
+		int next_x = kd_columns[d][0];
+		int next_y = kd_columns[d][1];
 		debug("Forward track from xy(%d,%d) to xy(%d,%d)\n",
 		    x, y, next_x, next_y);
 
@@ -1293,7 +1733,7 @@ diff_algo_myers(const struct diff_algo_config *algo_config,
 	rc = DIFF_RC_OK;
 
 return_rc:
-	free(kd_buf);
+	diff_arena_release(arena, &arena_mark);
 	debug("** END %s rc=%d\n", __func__, rc);
 	return rc;
 }
@@ -28,112 +28,195 @@
 #include "diff_main.h"
 #include "debug.h"
 
-/* Set unique_here = true for all atoms that exist exactly once in this list. */
-static void
-diff_atoms_mark_unique(struct diff_data *dd, unsigned int *unique_count)
+/*
+ * Per-atom state for the Patience Diff algorithm, kept in a side array
+ * allocated by diff_algo_patience() and hung off diff_data->algo_data
+ * only while patience actually runs.  The atoms proper stay as small
+ * as the Myers algorithms like them.
+ */
+struct atom_patience {
+	bool unique_here;
+	bool unique_in_both;
+	struct diff_atom *pos_in_other;
+	struct diff_atom *prev_stack;
+	struct range identical_lines;
+};
+
+/* The patience state for a given atom of `_dd'. */
+#define PATIENCE(_dd, _atom) \
+	(((struct atom_patience *)(_dd)->algo_data) \
+	    [DD_ATOM_INDEX(_dd, _atom)])
+
+/*
+ * Occurrence index over the atoms of one diff_data: a hash table keyed
+ * by the atoms' precomputed hash values, recording for each distinct
+ * atom content how often it occurs and where it occurs first.  Building
+ * the index is O(n), and it replaces the quadratic all-against-all
+ * scans that uniqueness marking would otherwise need.
+ */
+struct diff_occurrence {
+	struct diff_atom *atom;		/* first atom with this content */
+	unsigned int count;		/* number of occurrences */
+	struct diff_occurrence *next;	/* same-bucket chain */
+};
+
+struct diff_atom_index {
+	struct diff_occurrence **buckets;
+	unsigned int nbuckets;		/* always a power of two */
+	/* One preallocated entry per atom; entries for duplicate
+	 * contents remain unused. */
+	struct diff_occurrence *pool;
+	unsigned int pool_used;
+};
+
+/*
+ * The atomizer's checksum is cheap and clusters easily; scramble it
+ * before deriving a bucket number from the low bits.
+ */
+static inline unsigned int
+diff_atom_index_bucket(const struct diff_atom_index *idx,
+    const struct diff_atom *atom)
 {
-	struct diff_atom *atom, *anext;
-	unsigned int count = 0;
+	return (atom->hash * 2654435761u) & (idx->nbuckets - 1);
+}
 
-	DD_ATOM_FOREACH(atom, dd, 0) {
-		atom->patience.unique_here = true;
-		atom->patience.unique_in_both = true;
-		count++;
+static struct diff_occurrence *
+diff_atom_index_find(const struct diff_atom_index *idx,
+    const struct diff_atom *atom)
+{
+	struct diff_occurrence *oc;
+
+	oc = idx->buckets[diff_atom_index_bucket(idx, atom)];
+	for (; oc != NULL; oc = oc->next) {
+		if (diff_atom_same(oc->atom, atom))
+			return oc;
 	}
+	return NULL;
+}
+
+static enum diff_rc
+diff_atom_index_init(struct diff_atom_index *idx, struct diff_data *dd,
+    struct diff_arena *arena)
+{
+	struct diff_atom *atom;
+	struct diff_occurrence *oc;
+	unsigned int nbuckets = 4;
+
+	while (nbuckets < DD_ATOM_NB(dd) * 2 && nbuckets < (1u << 31))
+		nbuckets <<= 1;
+
+	*idx = (struct diff_atom_index){};
+	idx->buckets = diff_arena_alloc(arena, nbuckets,
+	    sizeof(struct diff_occurrence *));
+	if (idx->buckets == NULL)
+		return DIFF_RC_ENOMEM;
+	idx->nbuckets = nbuckets;
+	idx->pool = diff_arena_alloc(arena, DD_ATOM_NB(dd),
+	    sizeof(struct diff_occurrence));
+	if (idx->pool == NULL)
+		return DIFF_RC_ENOMEM;
+
 	DD_ATOM_FOREACH(atom, dd, 0) {
-		if (!atom->patience.unique_here)
-			continue;
+		oc = diff_atom_index_find(idx, atom);
+		if (oc == NULL) {
+			unsigned int b = diff_atom_index_bucket(idx, atom);
+
+			oc = &idx->pool[idx->pool_used++];
+			oc->atom = atom;
+			oc->next = idx->buckets[b];
+			idx->buckets[b] = oc;
+		}
+		oc->count++;
+	}
 
-		DD_ATOM_FOREACH(anext, dd, DD_ATOM_INDEX(dd, atom + 1)) {
-			if (diff_atom_same(atom, anext)) {
-				if (atom->patience.unique_here) {
-					atom->patience.unique_here = false;
-					atom->patience.unique_in_both = false;
-					count--;
-				}
-				anext->patience.unique_here = false;
-				anext->patience.unique_in_both = false;
-				count--;
-			}
+	return DIFF_RC_OK;
+}
+
+/* Set unique_here = true for all atoms that exist exactly once in this list. */
+static enum diff_rc
+diff_atoms_mark_unique(struct diff_data *dd, struct diff_atom_index *idx,
+    struct diff_arena *arena, unsigned int *unique_count)
+{
+	struct diff_atom *atom;
+	unsigned int count = 0;
+	enum diff_rc rc;
+
+	rc = diff_atom_index_init(idx, dd, arena);
+	if (rc != DIFF_RC_OK)
+		return rc;
+
+	DD_ATOM_FOREACH(atom, dd, 0) {
+		if (diff_atom_index_find(idx, atom)->count == 1) {
+			PATIENCE(dd, atom).unique_here = true;
+			PATIENCE(dd, atom).unique_in_both = true;
+			count++;
+		} else {
+			PATIENCE(dd, atom).unique_here = false;
+			PATIENCE(dd, atom).unique_in_both = false;
 		}
+		PATIENCE(dd, atom).pos_in_other = NULL;
 	}
 	if (unique_count)
 		*unique_count = count;
+	return DIFF_RC_OK;
 }
 
 /*
  * Mark those lines as atom->patience.unique_in_both = true that appear
  * exactly once in each side.
  */
-static void
+static enum diff_rc
 diff_atoms_mark_unique_in_both(struct diff_data *left, struct diff_data *right,
-    unsigned int *unique_in_both_count)
+    struct diff_arena *arena, unsigned int *unique_in_both_count)
 {
+	struct diff_atom_index left_idx, right_idx;
 	unsigned int unique_in_both;
-	struct diff_atom *atom, *j;
-	int found_in_b;
-	bool found_in_a;
+	struct diff_occurrence *oc;
+	struct diff_atom *atom;
+	enum diff_rc rc;
 
 	/*
-	 * Derive the final unique_in_both count without needing an
-	 * explicit iteration. So this is just some optimiziation to
-	 * save one iteration in the end.
+	 * Derive the final unique_in_both count while pairing up the
+	 * two sides, so no extra iteration is needed in the end.
 	 */
-	diff_atoms_mark_unique(left, &unique_in_both);
-	diff_atoms_mark_unique(right, NULL);
+	rc = diff_atoms_mark_unique(left, &left_idx, arena, &unique_in_both);
+	if (rc != DIFF_RC_OK)
+		return rc;
+	rc = diff_atoms_mark_unique(right, &right_idx, arena, NULL);
+	if (rc != DIFF_RC_OK)
+		return rc;
 
 	debug("unique_in_both %u\n", unique_in_both);
 
 	DD_ATOM_FOREACH(atom, left, 0) {
-		if (!atom->patience.unique_here)
+		if (!PATIENCE(left, atom).unique_here)
 			continue;
-		found_in_b = 0;
-		DD_ATOM_FOREACH(j, right, 0) {
-			if (!diff_atom_same(atom, j))
-				continue;
-			if (!j->patience.unique_here) {
-				found_in_b = 2; /* or more */
-				break;
-			} else {
-				found_in_b = 1;
-				j->patience.pos_in_other = atom;
-				atom->patience.pos_in_other = j;
-			}
-		}
-
-		if (found_in_b == 0 || found_in_b > 1) {
-			atom->patience.unique_in_both = false;
+		oc = diff_atom_index_find(&right_idx, atom);
+		if (oc != NULL && oc->count == 1) {
+			PATIENCE(right, oc->atom).pos_in_other = atom;
+			PATIENCE(left, atom).pos_in_other = oc->atom;
+		} else {
+			PATIENCE(left, atom).unique_in_both = false;
 			unique_in_both--;
-			debug("unique_in_both %u  (%d) ", unique_in_both,
-			    found_in_b);
+			debug("unique_in_both %u  (%u) ", unique_in_both,
+			    oc ? oc->count : 0);
 			debug_dump_atom(left, NULL, atom);
 		}
 	}
 
 	/*
-	 * Still need to unmark right[*]->patience.unique_in_both for
-	 * atoms that don't exist in left
+	 * Still need to unmark unique_in_both on the right for atoms
+	 * that don't exist in left; those never got paired up above.
 	 */
 	DD_ATOM_FOREACH(atom, right, 0) {
-		if (!atom->patience.unique_here ||
-		    !atom->patience.unique_in_both)
-			continue;
-		found_in_a = false;
-		DD_ATOM_FOREACH(j, left, 0) {
-			if (!j->patience.unique_in_both)
-				continue;
-			if (!diff_atom_same(atom, j))
-				continue;
-			found_in_a = true;
-			break;
-		}
-
-		if (!found_in_a)
-			atom->patience.unique_in_both = false;
+		if (PATIENCE(right, atom).unique_in_both &&
+		    PATIENCE(right, atom).pos_in_other == NULL)
+			PATIENCE(right, atom).unique_in_both = false;
 	}
 
 	if (unique_in_both_count)
 		*unique_in_both_count = unique_in_both;
+	return DIFF_RC_OK;
 }
 
 static void
@@ -153,13 +236,13 @@ diff_atoms_swallow_identical_neighbors(struct diff_data *left,
 		struct diff_atom *l = DD_ATOM_AT(left, l_idx);
 
 		next_l_idx = l_idx + 1;
-		if (!l->patience.unique_in_both)
+		if (!PATIENCE(left, l).unique_in_both)
 			continue;
 
 		debug("check identical lines around ");
 		debug_dump_atom(left, right, l);
 
-		r_idx = DD_ATOM_INDEX(right, l->patience.pos_in_other);
+		r_idx = DD_ATOM_INDEX(right, PATIENCE(left, l).pos_in_other);
 
 
 		/* Swallow upwards.
@@ -185,24 +268,29 @@ diff_atoms_swallow_identical_neighbors(struct diff_data *left,
 		    diff_atom_same(DD_ATOM_AT(left, identical_l.end),
 			DD_ATOM_AT(right, identical_r.end)));
 		    identical_l.end++, identical_r.end++, next_l_idx++) {
-			if (DD_ATOM_AT(left, identical_l.end)->patience.unique_in_both) {
+			if (PATIENCE(left,
+			    DD_ATOM_AT(left, identical_l.end)).unique_in_both) {
 				/*
 				 * Part of a chunk of identical lines, remove
 				 * from listing of unique_in_both lines
 				 */
-				DD_ATOM_AT(left, identical_l.end)->patience.unique_in_both = false;
-				DD_ATOM_AT(right, identical_r.end)->patience.unique_in_both = false;
+				PATIENCE(left, DD_ATOM_AT(left,
+				    identical_l.end)).unique_in_both = false;
+				PATIENCE(right, DD_ATOM_AT(right,
+				    identical_r.end)).unique_in_both = false;
 				(*unique_in_both_count)--;
 			}
 		}
 
-		l->patience.identical_lines = identical_l;
-		l->patience.pos_in_other->patience.identical_lines = identical_r;
+		PATIENCE(left, l).identical_lines = identical_l;
+		PATIENCE(right,
+		    PATIENCE(left, l).pos_in_other).identical_lines =
+		    identical_r;
 
 		l_min = identical_l.end;
 		r_min = identical_r.end;
 
-		if (!range_empty(&l->patience.identical_lines)) {
+		if (!range_empty(&PATIENCE(left, l).identical_lines)) {
 			debug("common-unique line at l=%u r=%u"
 			    " swallowed identical lines l=%u-%u r=%u-%u\n",
 			    l_idx, r_idx,
@@ -228,16 +316,43 @@ diff_algo_patience(const struct diff_algo_config *algo_config,
 {
 	struct diff_data *left = &state->left;
 	struct diff_data *right = &state->right;
+	struct diff_arena *arena = &state->result->arena;
+	struct diff_arena_mark arena_mark;
 	unsigned int unique_in_both_count;
 	enum diff_rc rc = DIFF_RC_ENOMEM;
 
 	debug("\n** %s\n", __func__);
 
+	state->result->stats.patience_passes++;
+
+	/*
+	 * All transient state of this pass comes from the arena and is
+	 * released in one go on the way out.
+	 */
+	diff_arena_mark(arena, &arena_mark);
+
+	/*
+	 * The patience state for all atoms lives in side arrays for the
+	 * duration of this call; see struct atom_patience.
+	 */
+	left->algo_data = diff_arena_alloc(arena, DD_ATOM_NB(left),
+	    sizeof(struct atom_patience));
+	if (left->algo_data == NULL)
+		goto return_rc;
+	right->algo_data = diff_arena_alloc(arena, DD_ATOM_NB(right),
+	    sizeof(struct atom_patience));
+	if (right->algo_data == NULL)
+		goto return_rc;
+
 	/*
 	 * Find those lines that appear exactly once in 'left' and exactly
 	 * once in 'right'.
 	 */
-	diff_atoms_mark_unique_in_both(left, right, &unique_in_both_count);
+	rc = diff_atoms_mark_unique_in_both(left, right, arena,
+	    &unique_in_both_count);
+	if (rc != DIFF_RC_OK)
+		goto return_rc;
+	rc = DIFF_RC_ENOMEM;
 
 	debug("unique_in_both_count %u\n", unique_in_both_count);
 	debug("left:\n");
@@ -250,7 +365,8 @@ diff_algo_patience(const struct diff_algo_config *algo_config,
 		 * Cannot apply Patience, tell the caller to use fallback_algo
 		 * instead.
 		 */
-		return DIFF_RC_USE_DIFF_ALGO_FALLBACK;
+		rc = DIFF_RC_USE_DIFF_ALGO_FALLBACK;
+		goto return_rc;
 	}
 
 	diff_atoms_swallow_identical_neighbors(left, right,
@@ -278,8 +394,10 @@ diff_algo_patience(const struct diff_algo_config *algo_config,
 		unsigned int target_stack;
 
 		/* One chunk of storage for atom pointers */
-		atom_pointers = recallocarray(NULL, 0, unique_in_both_count * 2,
-		    sizeof(struct diff_atom*));
+		atom_pointers = diff_arena_alloc(arena,
+		    unique_in_both_count * 2, sizeof(struct diff_atom*));
+		if (atom_pointers == NULL)
+			goto return_rc;
 
 		/*
 		 * Half for the list of atoms that still need to be put on
@@ -297,7 +415,7 @@ diff_algo_patience(const struct diff_algo_config *algo_config,
 		/* Take all common, unique items from 'left' ... */
 		uniques_end = uniques;
 		DD_ATOM_FOREACH(atom, left, 0) {
-			if (!atom->patience.unique_in_both)
+			if (!PATIENCE(left, atom).unique_in_both)
 				continue;
 			*uniques_end = atom;
 			uniques_end++;
@@ -330,7 +448,8 @@ diff_algo_patience(const struct diff_algo_config *algo_config,
 				while (lo < hi) {
 					unsigned int mid = (lo + hi) >> 1;
 
-					if (patience_stacks[mid]->patience.pos_in_other < atom->patience.pos_in_other)
+					if (PATIENCE(left, patience_stacks[mid]).pos_in_other <
+						    PATIENCE(left, atom).pos_in_other)
 						lo = mid + 1;
 					else
 						hi = mid;
@@ -349,7 +468,7 @@ diff_algo_patience(const struct diff_algo_config *algo_config,
 			 * left, which will form the final longest sequence
 			 * later.
 			 */
-			atom->patience.prev_stack = target_stack ?
+			PATIENCE(left, atom).prev_stack = target_stack ?
 			    patience_stacks[target_stack - 1] : NULL;
 		}
 
@@ -362,19 +481,20 @@ diff_algo_patience(const struct diff_algo_config *algo_config,
 
 		/*
 		 * uniques and patience_stacks are no longer needed.
-		 * Backpointers are in atom->patience.prev_stack
+		 * Backpointers are in PATIENCE(left, atom).prev_stack
 		 */
-		free(atom_pointers);
 	}
 
-	lcs = recallocarray(NULL, 0, lcs_count, sizeof(struct diff_atom*));
+	lcs = diff_arena_alloc(arena, lcs_count, sizeof(struct diff_atom*));
+	if (lcs == NULL)
+		goto return_rc;
 
 	struct diff_atom **lcs_backtrace_pos = &lcs[lcs_count - 1];
 	struct diff_atom *atom;
 	unsigned int i;
 
 	for (atom = lcs_tail; atom;
-	    atom = atom->patience.prev_stack, lcs_backtrace_pos--) {
+	    atom = PATIENCE(left, atom).prev_stack, lcs_backtrace_pos--) {
 		assert(lcs_backtrace_pos >= lcs);
 		*lcs_backtrace_pos = atom;
 	}
@@ -412,17 +532,17 @@ diff_algo_patience(const struct diff_algo_config *algo_config,
 
 		if (i < lcs_count) {
 			atom = lcs[i];
-			atom_r = atom->patience.pos_in_other;
+			atom_r = PATIENCE(left, atom).pos_in_other;
 			debug("lcs[%u] = left[%ld] = right[%ld]\n", i,
 			    DD_ATOM_INDEX(left, atom),
 			    DD_ATOM_INDEX(right, atom_r));
-			left_idx = atom->patience.identical_lines.start;
-			right_idx = atom_r->patience.identical_lines.start;
+			left_idx = PATIENCE(left, atom).identical_lines.start;
+			right_idx = PATIENCE(right, atom_r).identical_lines.start;
 			debug(" identical lines l %u-%u  r %u-%u\n",
-			    atom->patience.identical_lines.start,
-			    atom->patience.identical_lines.end,
-			    atom_r->patience.identical_lines.start,
-			    atom_r->patience.identical_lines.end);
+			    PATIENCE(left, atom).identical_lines.start,
+			    PATIENCE(left, atom).identical_lines.end,
+			    PATIENCE(right, atom_r).identical_lines.start,
+			    PATIENCE(right, atom_r).identical_lines.end);
 		} else {
 			atom = NULL;
 			atom_r = NULL;
@@ -498,13 +618,15 @@ diff_algo_patience(const struct diff_algo_config *algo_config,
 		 */
 		if (atom) {
 			if (!diff_state_add_chunk(state, true,
-			    DD_ATOM_AT(left, atom->patience.identical_lines.start),
-			    range_len(&atom->patience.identical_lines),
-			    DD_ATOM_AT(right, atom_r->patience.identical_lines.start),
-			    range_len(&atom_r->patience.identical_lines)))
+			    DD_ATOM_AT(left,
+				PATIENCE(left, atom).identical_lines.start),
+			    range_len(&PATIENCE(left, atom).identical_lines),
+			    DD_ATOM_AT(right,
+				PATIENCE(right, atom_r).identical_lines.start),
+			    range_len(&PATIENCE(right, atom_r).identical_lines)))
 				goto return_rc;
-			left_pos = atom->patience.identical_lines.end;
-			right_pos = atom_r->patience.identical_lines.end;
+			left_pos = PATIENCE(left, atom).identical_lines.end;
+			right_pos = PATIENCE(right, atom_r).identical_lines.end;
 		} else {
 			left_pos = left_idx + 1;
 			right_pos = right_idx + 1;
@@ -518,6 +640,8 @@ diff_algo_patience(const struct diff_algo_config *algo_config,
 	rc = DIFF_RC_OK;
 
 return_rc:
-	free(lcs);
+	diff_arena_release(arena, &arena_mark);
+	left->algo_data = NULL;
+	right->algo_data = NULL;
 	return rc;
 }
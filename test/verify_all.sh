@@ -43,14 +43,45 @@ verify_diff_script() {
         return 0
 }
 
-for left in test*.left.* ; do
-        right="$(echo "$left" | sed 's/\.left\./.right./')"
-        expected_diff="$(echo "$left" | sed 's/test\([0-9]*\)\..*/expect\1.diff/')"
-        got_diff="verify.$expected_diff"
+# Round-trip every test pair, with each algorithm chain in turn: the
+# diffs may differ per algorithm, but patch must always be able to
+# reconstruct both files from them.
+for algo in "" "-A patience" "-A histogram" ; do
+        for left in test*.left.* ; do
+                right="$(echo "$left" | sed 's/\.left\./.right./')"
+                expected_diff="$(echo "$left" | sed 's/test\([0-9]*\)\..*/expect\1.diff/')"
+                got_diff="verify.$expected_diff"
 
-        "$diff_prog" -u "$left" "$right" > "$got_diff"
+                "$diff_prog" $algo -u "$left" "$right" > "$got_diff"
 
-        set -e
+                set -e
 	verify_diff_script "$left" "$right" "$got_diff"
-        set +e
+                set +e
+        done
 done
+
+# A CRLF pair must diff as whole lines; splitting "\r\n" used to double
+# the atom count and shift every line number.
+"$diff_prog" crlf001.left.txt crlf001.right.txt > verify.crlf001.out
+if ! cmp -s crlf001.expect verify.crlf001.out ; then
+        echo "FAIL: crlf001: unexpected diff output"
+        exit 1
+fi
+echo "OK: $diff_prog crlf001.left.txt crlf001.right.txt"
+
+# -b: a pair differing only in the amount of blanks is equal under -b
+# and different without it.
+if [ -n "$("$diff_prog" -b -u blank001.left.txt blank001.right.txt)" ] ; then
+        echo "FAIL: blank001: -b found differences"
+        exit 1
+fi
+if ! "$diff_prog" -q -b blank001.left.txt blank001.right.txt ; then
+        echo "FAIL: blank001: -q -b exit status"
+        exit 1
+fi
+if "$diff_prog" -q blank001.left.txt blank001.right.txt > /dev/null ; then
+        echo "FAIL: blank001: -q exit status"
+        exit 1
+fi
+echo "OK: $diff_prog -b blank001.left.txt blank001.right.txt"
+